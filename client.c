@@ -1,7 +1,11 @@
 #include "db.h"
 
+#include <openssl/md5.h>
+
 #define PROT_TAGS_PER_SEARCH   16
 #define PROT_ORDERS_PER_SEARCH 4
+#define SEARCH_RADIX_MIN       1024
+#define SEARCH_WEIGHT_MAX      0xffff
 
 typedef enum {
 	ORDER_NONE,
@@ -10,11 +14,35 @@ typedef enum {
 	ORDER_MD5,
 } order_simple_t;
 
+/* How values of an ordering tag are compared (see sort_rec_t) */
+typedef enum {
+	SORT_KEY_TV, // Using the tv_cmp function
+	SORT_KEY_STR,
+	SORT_KEY_INT,
+	SORT_KEY_UINT,
+	SORT_KEY_DOUBLE,
+	SORT_KEY_DATETIME,
+} sort_key_kind_t;
+
+static const sort_key_kind_t sort_key_kinds[] = {
+	SORT_KEY_TV,       // NONE
+	SORT_KEY_STR,      // WORD
+	SORT_KEY_STR,      // STRING
+	SORT_KEY_INT,      // INT
+	SORT_KEY_UINT,     // UINT
+	SORT_KEY_DOUBLE,   // FLOAT
+	SORT_KEY_DOUBLE,   // F_STOP
+	SORT_KEY_DOUBLE,   // STOP
+	SORT_KEY_DATETIME, // DATETIME
+	SORT_KEY_TV,       // GPS
+};
+
 typedef struct order {
-	int            sign;
-	order_simple_t simple;
-	tag_t          *tag;
-	tv_cmp_t       *cmp;
+	int             sign;
+	order_simple_t  simple;
+	tag_t           *tag;
+	tv_cmp_t        *cmp;
+	sort_key_kind_t kind;
 } order_t;
 
 typedef enum {
@@ -25,14 +53,16 @@ typedef enum {
 } tag_order_t;
 
 static const char *flagnames[] = {"tagname", "tagguid", "implied", "tagdata",
-                                  "ext", "created", "width", "height",
-                                  "imgdate", "modified", "rotate", NULL};
+                                  "tagdict", "ext", "created", "width",
+                                  "height", "imgdate", "modified", "rotate",
+                                  "count", "profile", NULL};
 
 typedef enum {
 	FLAG_RETURN_TAGNAMES,
 	FLAG_RETURN_TAGIDS,
 	FLAG_RETURN_IMPLIED,
 	FLAG_RETURN_TAGDATA,
+	FLAG_RETURN_TAGDICT,
 	FLAG_RETURN_EXTENSION,
 	FLAG_RETURN_CREATED,
 	FLAG_RETURN_WIDTH,
@@ -40,25 +70,100 @@ typedef enum {
 	FLAG_RETURN_IMGDATE,
 	FLAG_RETURN_MODIFIED,
 	FLAG_RETURN_ROTATE,
+	FLAG_COUNT_ONLY,
+	FLAG_PROFILE,
 	FLAG_LAST,
 } flag_t;
 #define FLAG(n) (1 << (n))
 #define FLAG_FIRST_SINGLE FLAG_RETURN_EXTENSION
 
+/* Groups of alternatives, "( .. | .. )". Each alternative is an AND *
+ * of T, t and nested groups. Nodes live in the connection arena.    */
+#define SEARCH_GROUP_DEPTH 8
+#define SEARCH_EXPR_MAX    64
+
+typedef enum {
+	EXPR_TAG,
+	EXPR_NOT_TAG,
+	EXPR_AND,
+	EXPR_OR,
+} expr_type_t;
+
+typedef struct search_expr search_expr_t;
+struct search_expr {
+	expr_type_t   type;
+	search_tag_t  tag;      // EXPR_TAG and EXPR_NOT_TAG
+	search_expr_t *child;   // EXPR_AND and EXPR_OR
+	search_expr_t *last;    // last child
+	search_expr_t *next;    // next sibling
+	ss128_key_t   key;      // same key, same sub-expression
+};
+
+/* Evaluated sub-expressions, so repeats are only evaluated once. */
+typedef struct expr_memo expr_memo_t;
+struct expr_memo {
+	expr_memo_t *next;
+	ss128_key_t key;
+	result_t    result; // sorted by post pointer
+};
+
+/* Fprofile: what do_search did, reported as RX lines before OK. */
+#define PROFILE_STEPS (2 * PROT_TAGS_PER_SEARCH + 8)
+
+typedef enum {
+	PHASE_NONE,
+	PHASE_INTERSECT,
+	PHASE_EXCLUDE,
+	PHASE_SORT,
+	PHASE_RENDER,
+	PHASE_LAST,
+} profile_phase_t;
+static const char *phase_names[] = {"", "intersect", "exclude", "sort",
+                                    "render"};
+
+typedef struct profile_step {
+	const char         *op;
+	const search_tag_t *t;
+	uint32_t           count;
+} profile_step_t;
+
+typedef struct search_profile {
+	profile_step_t  steps[PROFILE_STEPS];
+	unsigned int    of_steps;
+	profile_phase_t phase;
+	uint64_t        mark;
+	uint64_t        time[PHASE_LAST];
+	unsigned long   tv_start;
+	unsigned long   cmps;
+	const char      *sort;
+} search_profile_t;
+
 typedef struct search {
 	search_tag_t tags[PROT_TAGS_PER_SEARCH];
 	search_tag_t excluded_tags[PROT_TAGS_PER_SEARCH];
+	rank_tag_t   ranked[PROT_TAGS_PER_SEARCH];
 	post_t       *post;
 	unsigned int of_tags;
 	unsigned int of_excluded_tags;
+	unsigned int of_ranked;
 	order_t      orders[PROT_ORDERS_PER_SEARCH];
 	unsigned int of_orders;
 	int          flags;
 	long         range_start;
 	long         range_end;
 	md5_t        range_md5;
+	MD5_CTX      key_ctx; // normalised search, for the result cache
+	search_expr_t *groups; // list of EXPR_OR, ANDed with tags
+	search_expr_t *groups_last;
+	search_expr_t *group_stack[SEARCH_GROUP_DEPTH];
+	unsigned int  group_depth;
+	unsigned int  of_exprs;
+	expr_memo_t   *memo;
+	search_profile_t prof;
 	unsigned int range_used : 1;
 	unsigned int failed : 1;
+	unsigned int cursor : 1;
+	unsigned int list_order : 1; // Keep the order of the first tag
 } search_t;
 static post_t null_post; /* search->post for not found posts */
 
@@ -214,18 +319,6 @@ static void taglimit_free(connection_t *conn, taglimit_t *limit)
 	ss128_free(&limit->tree);
 }
 
-static int sort_search(const void *_t1, const void *_t2, void *_data)
-{
-	const search_tag_t *t1 = (const search_tag_t *)_t1;
-	const search_tag_t *t2 = (const search_tag_t *)_t2;
-	uint32_t c1 = tag_count(t1->tag, t1->weak, NULL);
-	uint32_t c2 = tag_count(t2->tag, t2->weak, NULL);
-	(void) _data;
-	if (c1 < c2) return -1;
-	if (c1 > c2) return 1;
-	return 0;
-}
-
 typedef struct {
 	connection_t *conn;
 	const char   *text;
@@ -314,21 +407,153 @@ static int parse_range(const char *args, long *r_start, long *r_end, md5_t *r_md
 	return 0;
 }
 
+static search_expr_t *expr_new(connection_t *conn, search_t *search,
+                               expr_type_t type)
+{
+	search_expr_t *expr;
+	if (search->of_exprs == SEARCH_EXPR_MAX) {
+		c_close_error(conn, E_OVERFLOW);
+		return NULL;
+	}
+	if (c_alloc(conn, (void **)&expr, sizeof(*expr))) {
+		c_close_error(conn, E_MEM);
+		return NULL;
+	}
+	memset(expr, 0, sizeof(*expr));
+	expr->type = type;
+	search->of_exprs++;
+	if (type == EXPR_OR && !search->group_depth) {
+		if (search->groups_last) {
+			search->groups_last->next = expr;
+		} else {
+			search->groups = expr;
+		}
+		search->groups_last = expr;
+	} else {
+		// Into the current alternative (or group, for alternatives)
+		search_expr_t *parent;
+		parent = search->group_stack[search->group_depth - 1];
+		if (type != EXPR_AND) parent = parent->last;
+		if (parent->last) {
+			parent->last->next = expr;
+		} else {
+			parent->child = expr;
+		}
+		parent->last = expr;
+	}
+	return expr;
+}
+
+static void expr_key_tag(search_expr_t *expr, const char *spec)
+{
+	MD5_CTX ctx;
+	md5_t   md5;
+	char    type = expr->type;
+	char    weak = expr->tag.weak;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, &type, 1);
+	MD5_Update(&ctx, &weak, 1);
+	MD5_Update(&ctx, expr->tag.tag->guid.data_u8, sizeof(guid_t));
+	MD5_Update(&ctx, spec, strlen(spec) + 1);
+	MD5_Final(md5.m, &ctx);
+	expr->key = md5.key;
+}
+
+/* Groups and alternatives get keys from their parts when they end. */
+static int expr_finish(connection_t *conn, search_expr_t *expr)
+{
+	MD5_CTX ctx;
+	md5_t   md5;
+	char    type = expr->type;
+	if (!expr->child) return conn->error(conn, "|");
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, &type, 1);
+	for (search_expr_t *e = expr->child; e; e = e->next) {
+		MD5_Update(&ctx, &e->key, sizeof(e->key));
+	}
+	MD5_Final(md5.m, &ctx);
+	expr->key = md5.key;
+	return 0;
+}
+
+static int expr_group_cmd(connection_t *conn, search_t *search,
+                          const char *cmd)
+{
+	search_expr_t *group;
+	unsigned int  depth = search->group_depth;
+	const char    c = *cmd;
+
+	if (c == '(') {
+		if (depth == SEARCH_GROUP_DEPTH) {
+			return c_close_error(conn, E_OVERFLOW);
+		}
+		group = expr_new(conn, search, EXPR_OR);
+		if (!group) return 1;
+		search->group_stack[search->group_depth++] = group;
+		return !expr_new(conn, search, EXPR_AND);
+	}
+	if (!depth) return conn->error(conn, cmd);
+	group = search->group_stack[depth - 1];
+	if (expr_finish(conn, group->last)) return 1;
+	if (c == '|') return !expr_new(conn, search, EXPR_AND);
+	search->group_depth--;
+	return expr_finish(conn, group);
+}
+
+/* The cache key hashes what each search argument means, so that *
+ * TN and TG forms of the same tag share an entry.                */
+static void search_key_tag(search_t *search, char type, const search_tag_t *t,
+                           const char *spec)
+{
+	char weak = t->weak;
+	MD5_Update(&search->key_ctx, &type, 1);
+	MD5_Update(&search->key_ctx, &weak, 1);
+	MD5_Update(&search->key_ctx, t->tag->guid.data_u8, sizeof(guid_t));
+	MD5_Update(&search->key_ctx, spec, strlen(spec) + 1);
+}
+
 static int build_search_cmd(connection_t *conn, char *cmd, void *search_,
                             prot_cmd_flag_t flags)
 {
-	search_t     *search = search_;
-	const char   *args = cmd + 1;
-	int          i;
-	int          r;
-	search_tag_t *t;
-
-	(void)flags;
+	search_t      *search = search_;
+	const char    *args = cmd + 1;
+	int           i;
+	int           r;
+	search_tag_t  *t;
+	search_expr_t *expr = NULL;
 
 	switch(*cmd) {
 		case 'T': // Tag
 		case 't': // Removed tag
-			if (*cmd == 'T') {
+		case 'W': // Weighted tag, ranks the result
+			if (*cmd == 'W') {
+				rank_tag_t *rt;
+				if (search->group_depth) return conn->error(conn, cmd);
+				if (search->of_ranked == PROT_TAGS_PER_SEARCH) {
+					return c_close_error(conn, E_OVERFLOW);
+				}
+				rt = &search->ranked[search->of_ranked];
+				search->of_ranked++;
+				rt->weight = 1;
+				if (*args >= '0' && *args <= '9') {
+					char *end;
+					unsigned long w = strtoul(args, &end, 10);
+					if (*end != ':' || !w || w > SEARCH_WEIGHT_MAX) {
+						return conn->error(conn, cmd);
+					}
+					rt->weight = w;
+					args = end + 1;
+				}
+				MD5_Update(&search->key_ctx, &rt->weight,
+				           sizeof(rt->weight));
+				t = &rt->t;
+			} else if (search->group_depth) {
+				expr = expr_new(conn, search, *cmd == 'T'
+				                              ? EXPR_TAG
+				                              : EXPR_NOT_TAG);
+				if (!expr) return 1;
+				t = &expr->tag;
+			} else if (*cmd == 'T') {
 				if (search->of_tags == PROT_TAGS_PER_SEARCH) {
 					return c_close_error(conn, E_OVERFLOW);
 				}
@@ -352,9 +577,13 @@ static int build_search_cmd(connection_t *conn, char *cmd, void *search_,
 			}
 			if (*args == 'G') {
 				char buf[strlen(args)];
+				const char *spec = "";
 				*buf = 0;
+				if (strlen(args + 1) > 27) spec = args + 1 + 27;
 				t->tag = tag_find_guidstr_value(args + 1, &t->cmp,
 				                                &t->val, buf);
+				if (t->tag) search_key_tag(search, *cmd, t, spec);
+				if (t->tag && expr) expr_key_tag(expr, spec);
 				if (t->tag && *buf) {
 					strcpy(cmd, buf);
 					t->val.v_str = cmd;
@@ -362,6 +591,8 @@ static int build_search_cmd(connection_t *conn, char *cmd, void *search_,
 			} else if (*args == 'N') {
 				t->tag = tag_find_name(args + 1, T_DONTCARE, NULL);
 				t->cmp = CMP_NONE;
+				if (t->tag) search_key_tag(search, *cmd, t, "");
+				if (t->tag && expr) expr_key_tag(expr, "");
 			} else {
 				return conn->error(conn, cmd);
 			}
@@ -389,7 +620,9 @@ static int build_search_cmd(connection_t *conn, char *cmd, void *search_,
 				order->simple = 0;
 				order->tag = tag;
 				order->cmp = tv_cmp[tag->valuetype];
+				order->kind = sort_key_kinds[tag->valuetype];
 			}
+			MD5_Update(&search->key_ctx, cmd, strlen(cmd) + 1);
 			search->of_orders++;
 			break;
 		case 'F': // Flag (option)
@@ -411,34 +644,96 @@ static int build_search_cmd(connection_t *conn, char *cmd, void *search_,
 				conn->error(conn, cmd);
 			}
 			break;
+		case 'C': // Keep result in a 'C'ursor
+			if (*args) return conn->error(conn, cmd);
+			search->cursor = 1;
+			break;
+		case '(': // Start a group of alternatives
+		case '|': // Next alternative
+		case ')': // End of group
+			if (*args) return conn->error(conn, cmd);
+			if (expr_group_cmd(conn, search, cmd)) return 1;
+			MD5_Update(&search->key_ctx, cmd, 2);
+			break;
 		default:
 			return c_close_error(conn, E_SYNTAX);
 			break;
 	}
+	if (search->group_depth) {
+		if (!strchr("Tt(|)", *cmd)) return conn->error(conn, cmd);
+		if (flags & CMDFLAG_LAST) return conn->error(conn, "(");
+	}
 	return 0;
 }
 
 static void init_search(search_t *search)
 {
 	memset(search, 0, sizeof(*search));
+	MD5_Init(&search->key_ctx);
 	search->range_start = -1;
 	search->range_end = LONG_MAX - 1;
 }
 
-static int setup_search(search_t *search)
+static uint64_t profile_now(void)
 {
-	if (!search->of_tags && !search->post) {
-		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Charges the time since the last switch to the current phase. */
+static void profile_phase(search_t *search, profile_phase_t phase)
+{
+	search_profile_t *prof = &search->prof;
+	uint64_t now;
+
+	if (!(search->flags & FLAG(FLAG_PROFILE))) return;
+	now = profile_now();
+	if (prof->phase) prof->time[prof->phase] += now - prof->mark;
+	prof->phase = phase;
+	prof->mark = now;
+}
+
+static void profile_step(search_t *search, const char *op,
+                         const search_tag_t *t, uint32_t count)
+{
+	search_profile_t *prof = &search->prof;
+	profile_step_t   *step;
+
+	if (!(search->flags & FLAG(FLAG_PROFILE))) return;
+	if (prof->of_steps == PROFILE_STEPS) return;
+	step = &prof->steps[prof->of_steps++];
+	step->op    = op;
+	step->t     = t;
+	step->count = count;
+}
+
+static void profile_print(connection_t *conn, search_t *search)
+{
+	search_profile_t *prof = &search->prof;
+
+	if (!(search->flags & FLAG(FLAG_PROFILE))) return;
+	profile_phase(search, PHASE_NONE);
+	for (unsigned int i = 0; i < prof->of_steps; i++) {
+		const profile_step_t *step = &prof->steps[i];
+		c_printf(conn, "RXstep %s", step->op);
+		if (step->t) {
+			const char *weak = "";
+			if (step->t->weak == T_YES) weak = "~";
+			if (step->t->weak == T_NO) weak = "!";
+			c_printf(conn, " %sG%s", weak,
+			         guid_guid2str(step->t->tag->guid));
+		}
+		c_printf(conn, " %x\n", step->count);
 	}
-	/* Searching is faster if ordered by post-count,  *
-	 * but group ordering is implicit in match order. */
-	int can_sort = 1;
-	for (unsigned int i = 0; i < search->of_orders; i++) {
-		if (search->orders[i].simple == ORDER_GROUP) can_sort = 0;
+	c_printf(conn, "RXtv %lx\n", tv_evaluations - prof->tv_start);
+	if (prof->sort) c_printf(conn, "RXsort %s %lx\n", prof->sort, prof->cmps);
+	c_printf(conn, "RXtime");
+	for (int i = PHASE_INTERSECT; i < PHASE_LAST; i++) {
+		c_printf(conn, " %s=%llx", phase_names[i],
+		         (unsigned long long)prof->time[i]);
 	}
-	if (can_sort) sort(search->tags, search->of_tags, sizeof(search_tag_t),
-	                   sort_search, NULL);
-	return 0;
+	c_printf(conn, "\n");
 }
 
 static int sorter(const void *_p1, const void *_p2, void *_search)
@@ -448,6 +743,7 @@ static int sorter(const void *_p1, const void *_p2, void *_search)
 	search_t     *search = _search;
 	unsigned int i;
 
+	search->prof.cmps++;
 	for (i = 0; i < search->of_orders; i++) {
 		order_t *order = &search->orders[i];
 		order_simple_t simple = order->simple;
@@ -456,8 +752,8 @@ static int sorter(const void *_p1, const void *_p2, void *_search)
 		if (simple) {
 			r = sorters[simple - 1](p1, p2);
 		} else {
-			tag_value_t *tv1 = post_tag_value(p1, order->tag);
-			tag_value_t *tv2 = post_tag_value(p2, order->tag);
+			tag_value_t *tv1 = post_column_value(p1, order->tag);
+			tag_value_t *tv2 = post_column_value(p2, order->tag);
 			if (tv1 && !tv2) r = 1;
 			if (!tv1 && tv2) r = -1;
 			if (tv1 && tv2) r = order->cmp(tv1, CMP_CMP, tv2, 0);
@@ -470,27 +766,33 @@ static int sorter(const void *_p1, const void *_p2, void *_search)
 static void tv_print_str(connection_t *conn, tag_value_t *tv)
 {
 	char *str = str_str2enc(tv->v_str);
-	c_printf(conn, "%s", str);
+	c_puts(conn, str);
 	free(str);
 }
 
 static void tv_print_int(connection_t *conn, tag_value_t *tv)
 {
 	if (tv->v_str == tag_value_null_marker) return;
-	c_printf(conn, "%lld", LL tv->val.v_int);
-	if (tv->fuzz.f_int) c_printf(conn, "+%lld", LL tv->fuzz.f_int);
+	c_putdec(conn, tv->val.v_int);
+	if (tv->fuzz.f_int) {
+		c_putc(conn, '+');
+		c_putdec(conn, tv->fuzz.f_int);
+	}
 }
 
 static void tv_print_uint(connection_t *conn, tag_value_t *tv)
 {
 	if (tv->v_str == tag_value_null_marker) return;
-	c_printf(conn, "%llx", ULL tv->val.v_uint);
-	if (tv->fuzz.f_uint) c_printf(conn, "+%lld", LL tv->fuzz.f_uint);
+	c_puthex(conn, tv->val.v_uint);
+	if (tv->fuzz.f_uint) {
+		c_putc(conn, '+');
+		c_putdec(conn, tv->fuzz.f_uint);
+	}
 }
 
 static void tv_print_rawstr(connection_t *conn, tag_value_t *tv)
 {
-	c_printf(conn, "%s", tv->v_str);
+	c_puts(conn, tv->v_str);
 }
 
 typedef void (tv_printer_t)(connection_t *, tag_value_t *);
@@ -510,9 +812,11 @@ tv_printer_t *tv_printer[] = {NULL, // NONE
 
 static void c_print_tag(connection_t *conn, const tag_t *tag, int flags,
                         int aliases, taglimit_t *limits, post_t *post);
+static void c_print_tagdict(connection_t *conn, const tag_t *tag, post_t *post);
 static void return_post(connection_t *conn, post_t *post, int flags)
 {
-	c_printf(conn, "RP%s", md5_md52str(post->md5));
+	c_write(conn, "RP", 2);
+	c_write(conn, md5_md52str(post->md5), 32);
 	for (int i = FLAG_FIRST_SINGLE; i < FLAG_LAST; i++) {
 		if (!(flags & FLAG(i))) continue;
 		for (const field_t *field = post_fields;
@@ -527,46 +831,56 @@ static void return_post(connection_t *conn, post_t *post, int flags)
 				} else {
 					printer = tv_printer[tag->valuetype];
 				}
-				tv = post_tag_value(post, tag);
+				tv = post_column_value(post, tag);
 				if (printer && tv) {
-					c_printf(conn, " F%s=", field->name);
+					c_write(conn, " F", 2);
+					c_write(conn, field->name, field->namelen);
+					c_putc(conn, '=');
 					printer(conn, tv);
 				}
 			}
 		}
 	}
-	if (flags & (FLAG(FLAG_RETURN_TAGNAMES) | FLAG(FLAG_RETURN_TAGIDS))) {
+	if (flags & (FLAG(FLAG_RETURN_TAGNAMES) | FLAG(FLAG_RETURN_TAGIDS)
+	             | FLAG(FLAG_RETURN_TAGDICT))
+	   ) {
 		post_taglist_t *tl = &post->tags;
 		post_taglist_t *impltl = post->implied_tags;
-		const char     *prefix = "";
-		c_printf(conn, " ");
+		int            weak = 0;
+		c_putc(conn, ' ');
 again:
 		while (tl) {
 			for (int i = 0; i < arraylen(tl->tags); i++) {
 				if (tl->tags[i]) {
 					const tag_t *tag = tl->tags[i];
-					c_printf(conn, ":");
-					if (tag->datatag) c_printf(conn, "D");
+					c_putc(conn, ':');
+					if (tag->datatag) c_putc(conn, 'D');
 					if (flags & FLAG(FLAG_RETURN_IMPLIED)
 					    && taglist_contains(impltl, tag)
 					   ) {
-						c_printf(conn, "I");
+						c_putc(conn, 'I');
+					}
+					if (weak) c_putc(conn, '~');
+					c_putc(conn, ' ');
+					if (flags & FLAG(FLAG_RETURN_TAGDICT)) {
+						c_print_tagdict(conn, tag, post);
+					} else {
+						c_print_tag(conn, tag, flags, 0,
+						            NULL, post);
 					}
-					c_printf(conn, "%s ", prefix);
-					c_print_tag(conn, tag, flags, 0, NULL, post);
 				}
 			}
 			tl = tl->next;
 		}
-		if (!*prefix) {
-			prefix = "~";
+		if (!weak) {
+			weak = 1;
 			tl = post->weak_tags;
 			impltl = post->implied_weak_tags;
 			goto again;
 		}
-		c_printf(conn, ":");
+		c_putc(conn, ':');
 	}
-	c_printf(conn, "\n");
+	c_putc(conn, '\n');
 }
 
 typedef struct post2result_data {
@@ -584,233 +898,1637 @@ static void post2result(ss128_key_t key, ss128_value_t value, void *data_)
 	data->error |= result_add_post(data->conn, data->result, post);
 }
 
-static void do_search(connection_t *conn, search_t *search, result_t *result)
+/* Turn the R argument into [range_start, range_end) of of_posts posts. *
+ * pos is one past the post specified with RM (or of_posts if missing). */
+static void search_set_range(search_t *search, long of_posts, long pos)
 {
-	memset(result, 0, sizeof(*result));
-	if (search->post) {
-		if (search->of_tags || search->of_excluded_tags) {
-			conn->error(conn, "E mutually exclusive options specified");
-			goto err;
-		}
-		if (search->post != &null_post) {
-			err1(result_add_post(conn, result, search->post));
-		}
-		goto done;
-	}
-	for (unsigned int i = 0; i < search->of_tags; i++) {
-		if (result_intersect(conn, result, &search->tags[i])) {
-			c_close_error(conn, E_MEM);
-			goto err;
-		}
-		if (!result->of_posts) goto done;
+	if (search->range_start == -1) {
+		search->range_start = 0;
+		search->range_end = of_posts;
+		return;
 	}
-	if (!result->of_posts) { // No positive criteria -> start with all posts
-		post2result_data_t data;
-		data.conn   = conn;
-		data.result = result;
-		data.error  = 0;
-		ss128_iterate(posts, post2result, &data);
-		if (data.error) {
-			c_close_error(conn, E_MEM);
-			goto err;
+	search->range_used = 1;
+	if (search->range_start < -1) { // around a specific post
+		if (search->range_end == -1 && search->range_start == -2) {
+			search->range_end = of_posts;
+		} else {
+			search->range_end += pos;
 		}
+		search->range_start = search->range_start + 2 + pos;
+		if (search->range_start < 0) search->range_start = 0;
+	} else {
+		search->range_end++;
 	}
-	for (unsigned int i = 0; i < search->of_excluded_tags; i++) {
-		if (result_remove_tag(conn, result, &search->excluded_tags[i])) {
-			c_close_error(conn, E_MEM);
-			goto err;
+	if (search->range_end > of_posts) search->range_end = of_posts;
+}
+
+/* Search results are cached on the normalised search (not flags or   *
+ * range). An entry remembers the generation of every tag it depends *
+ * on, and of the whole post set when it depends on all posts, and is *
+ * only used while none of those have changed. Entries are dropped in *
+ * LRU order when the slots or the memory budget run out. Results     *
+ * that only get a window sorted are kept unsorted, in the order they *
+ * were found in, so a hit sorts exactly what a new search would.     */
+#define SEARCH_CACHE_SLOTS   64
+#define SEARCH_CACHE_MEM_MAX (32 * 1024 * 1024)
+#define SEARCH_CACHE_DEPS    (2 * PROT_TAGS_PER_SEARCH + PROT_ORDERS_PER_SEARCH)
+
+typedef struct search_cache_entry {
+	ss128_key_t  key;
+	post_t       **posts;
+	uint32_t     of_posts;
+	uint32_t     post_generation;
+	unsigned int used;
+	unsigned int of_deps;
+	tag_t        *deps[SEARCH_CACHE_DEPS];
+	uint32_t     dep_generation[SEARCH_CACHE_DEPS];
+	unsigned int in_use    : 1;
+	unsigned int all_posts : 1;
+	unsigned int sorted    : 1;
+} search_cache_entry_t;
+
+static search_cache_entry_t search_cache[SEARCH_CACHE_SLOTS];
+static size_t               search_cache_mem = 0;
+static unsigned int         search_cache_clock = 0;
+unsigned long search_cache_hits = 0;
+unsigned long search_cache_misses = 0;
+
+static void search_cache_drop(search_cache_entry_t *entry)
+{
+	search_cache_mem -= entry->of_posts * sizeof(post_t *);
+	free(entry->posts);
+	memset(entry, 0, sizeof(*entry));
+}
+
+void search_cache_forget(const tag_t *tag)
+{
+	for (int i = 0; i < SEARCH_CACHE_SLOTS; i++) {
+		search_cache_entry_t *entry = &search_cache[i];
+		if (!entry->in_use) continue;
+		for (unsigned int j = 0; j < entry->of_deps; j++) {
+			if (entry->deps[j] == tag) {
+				search_cache_drop(entry);
+				break;
+			}
 		}
-		if (!result->of_posts) goto done;
 	}
-done:
-	if (result->of_posts > 1) {
-		sort(result->posts, result->of_posts, sizeof(post_t *),
-		     sorter, search);
+}
+
+static ss128_key_t search_key(search_t *search)
+{
+	md5_t md5;
+	MD5_Final(md5.m, &search->key_ctx);
+	return md5.key;
+}
+
+static int search_cache_valid(const search_cache_entry_t *entry)
+{
+	if (entry->all_posts && entry->post_generation != post_generation) {
+		return 0;
 	}
-	if (search->range_start == -1) {
-		search->range_start = 0;
-		search->range_end = result->of_posts;
-	} else {
-		search->range_used = 1;
-		if (search->range_start < -1) { // around a specific post
-			int range_start;
-			for (
-				range_start = 0;
-				range_start < (long)result->of_posts;
-				range_start++
-			) {
-				const post_t *post = result->posts[range_start];
-				if (!memcmp(&post->md5, &search->range_md5, sizeof(md5_t))) {
-					range_start++;
-					break;
-				}
-			}
-			if (search->range_end == -1 && search->range_start == -2) {
-				search->range_end = result->of_posts;
-			} else {
-				search->range_end += range_start;
-			}
-			search->range_start = search->range_start + 2 + range_start;
-			if (search->range_start < 0) search->range_start = 0;
-		} else {
-			search->range_end++;
-		}
-		if (search->range_end > (long)result->of_posts) {
-			search->range_end = result->of_posts;
+	for (unsigned int i = 0; i < entry->of_deps; i++) {
+		if (entry->deps[i]->generation != entry->dep_generation[i]) {
+			return 0;
 		}
 	}
-	return;
-err:
-	search->failed = 1;
+	return 1;
 }
 
-static void print_search(connection_t *conn, search_t *search, result_t *result)
+/* Returns 1 on a hit (result filled in), 0 on a miss, -1 on error. */
+static int search_cache_get(connection_t *conn, ss128_key_t key,
+                            result_t *result, int *r_sorted)
 {
-	if (search->range_used) c_printf(conn, "RR%x:%lx\n", result->of_posts, search->range_start);
-	if (result->of_posts && !search->failed) {
-		for (long i = search->range_start; i < search->range_end; i++) {
-			return_post(conn, result->posts[i], search->flags);
+	for (int i = 0; i < SEARCH_CACHE_SLOTS; i++) {
+		search_cache_entry_t *entry = &search_cache[i];
+		if (!entry->in_use || memcmp(&entry->key, &key, sizeof(key))) {
+			continue;
+		}
+		if (!search_cache_valid(entry)) {
+			search_cache_drop(entry);
+			break;
+		}
+		if (entry->of_posts) {
+			unsigned int z = entry->of_posts * sizeof(post_t *);
+			if (c_alloc(conn, (void **)&result->posts, z)) return -1;
+			memcpy(result->posts, entry->posts, z);
 		}
+		result->of_posts = result->room = entry->of_posts;
+		*r_sorted = entry->sorted;
+		entry->used = ++search_cache_clock;
+		search_cache_hits++;
+		return 1;
 	}
-	c_printf(conn, "OK\n");
-	result_free(conn, result);
+	search_cache_misses++;
+	return 0;
 }
 
-typedef struct c_print_alias {
-	connection_t *conn;
-	const tag_t  *tag;
-} c_print_alias_t;
+static void search_cache_add_dep(search_cache_entry_t *entry, tag_t *tag)
+{
+	entry->deps[entry->of_deps] = tag;
+	entry->dep_generation[entry->of_deps] = tag->generation;
+	entry->of_deps++;
+}
 
-static void c_print_alias_cb(ss128_key_t key, ss128_value_t value, void *data_)
+static unsigned int expr_count_tags(const search_expr_t *expr)
 {
-	c_print_alias_t *data = data_;
-	tagalias_t *tagalias = (tagalias_t *)value;
-	(void) key;
-	if (tagalias->tag == data->tag) {
-		c_printf(data->conn, "A%s ", tagalias->name);
+	unsigned int count = 0;
+	for (; expr; expr = expr->next) {
+		if (expr->type == EXPR_TAG || expr->type == EXPR_NOT_TAG) {
+			count++;
+		} else {
+			count += expr_count_tags(expr->child);
+		}
 	}
+	return count;
 }
 
-static void c_print_tag(connection_t *conn, const tag_t *tag, int flags,
-                        int aliases, taglimit_t *limits, post_t *post)
+static void search_cache_add_expr_deps(search_cache_entry_t *entry,
+                                       const search_expr_t *expr)
 {
-	if (!tag) return;
-	if (flags == ~0) c_printf(conn, "R");
-	if (flags & FLAG(FLAG_RETURN_TAGIDS)) {
-		c_printf(conn, "G%s ", guid_guid2str(tag->guid));
-	}
-	if (flags & FLAG(FLAG_RETURN_TAGNAMES)) {
-		c_printf(conn, "N%s ", tag->name);
-	}
-	if (aliases) {
-		c_print_alias_t data;
-		data.conn = conn;
-		data.tag  = tag;
-		ss128_iterate(tagaliases, c_print_alias_cb, &data);
-	}
-	if (flags & FLAG(FLAG_RETURN_TAGDATA)) {
-		int count, weak_count;
-		if (limits) {
-			ss128_value_t res;
-			if (ss128_find(&limits->tree, &res, tag->guid.key)) {
-				count = weak_count = 0;
-			} else {
-				taglimit_tag_t *tt = (taglimit_tag_t *)res;
-				count = tt->count[0];
-				weak_count = tt->count[1];
-			}
+	for (; expr; expr = expr->next) {
+		if (expr->type == EXPR_TAG || expr->type == EXPR_NOT_TAG) {
+			search_cache_add_dep(entry, expr->tag.tag);
 		} else {
-			count = tag->posts.count;
-			weak_count = tag->weak_posts.count;
-		}
-		c_printf(conn, "T%s ", tagtype_names[tag->type]);
-		if (tag->valuetype) {
-			c_printf(conn, "V%s", tag_value_types[tag->valuetype]);
-			if (post) {
-				tag_value_t *tv = post_tag_value(post, tag);
-				if (tv) {
-					c_printf(conn, "=");
-					tv_printer[tag->valuetype](conn, tv);
-				}
-			}
-			c_printf(conn, " ");
+			search_cache_add_expr_deps(entry, expr->child);
 		}
-		c_printf(conn, "P%x ", count);
-		c_printf(conn, "W%x",  weak_count);
-		if (tag->ordered) c_printf(conn, " Fordered");
-		if (tag->unsettable) c_printf(conn, " Funsettable");
-		if (tag->datatag) c_printf(conn, " Fdatatag");
-		if (flags != ~0) c_printf(conn, " ");
 	}
-	if (flags == ~0) c_printf(conn, "\n");
 }
 
-static void tag_search_add_res(tag_search_data_t *data, const tag_t *tag,
-                               int check_dup)
+static void search_cache_put(const search_t *search, ss128_key_t key,
+                             const result_t *result, int sorted)
 {
-	if (data->error) return;
-	if (data->datatags == T_NO && tag->datatag) return;
-	if (data->datatags == T_YES && !tag->datatag) return;
-	if (data->limits) {
-		ss128_value_t v;
-		if (ss128_find(&data->limits->tree, &v, tag->guid.key)) return;
+	size_t z = result->of_posts * sizeof(post_t *);
+	for (int i = 0; i < SEARCH_CACHE_SLOTS; i++) { // Replaces an unsorted one
+		search_cache_entry_t *entry = &search_cache[i];
+		if (entry->in_use && !memcmp(&entry->key, &key, sizeof(key))) {
+			search_cache_drop(entry);
+		}
 	}
-	if (check_dup) {
-		// This is terrible inefficient
-		for (int i = 0; i < data->tag_pos; i++) {
-			if (data->tag[i] == tag) return;
+	if (z > SEARCH_CACHE_MEM_MAX / 4) return;
+	if (search->of_tags + search->of_excluded_tags + search->of_orders
+	    + expr_count_tags(search->groups) > SEARCH_CACHE_DEPS
+	   ) {
+		return;
+	}
+	search_cache_entry_t *entry = NULL;
+	while (1) {
+		search_cache_entry_t *lru = NULL;
+		for (int i = 0; i < SEARCH_CACHE_SLOTS; i++) {
+			search_cache_entry_t *e = &search_cache[i];
+			if (!e->in_use) {
+				if (!entry) entry = e;
+			} else if (!lru || e->used < lru->used) {
+				lru = e;
+			}
 		}
+		if (entry && search_cache_mem + z <= SEARCH_CACHE_MEM_MAX) break;
+		search_cache_drop(lru);
+		entry = NULL;
 	}
-	if (data->tag_pos == data->tag_len) {
-		int old_len = data->tag_len;
-		int new_len = old_len ? old_len * 2 : 16;
-		int r;
-		data->tag = c_realloc(data->conn, data->tag,
-		                      sizeof(*data->tag) * old_len,
-		                      sizeof(*data->tag) * new_len, &r);
-		if (r) {
-			data->error = E_MEM;
-			return;
+	if (z) {
+		entry->posts = malloc(z);
+		if (!entry->posts) return;
+		memcpy(entry->posts, result->posts, z);
+	}
+	entry->key = key;
+	entry->of_posts = result->of_posts;
+	entry->post_generation = post_generation;
+	entry->all_posts = !search->of_tags;
+	for (unsigned int i = 0; i < search->of_tags; i++) {
+		search_cache_add_dep(entry, search->tags[i].tag);
+	}
+	for (unsigned int i = 0; i < search->of_excluded_tags; i++) {
+		search_cache_add_dep(entry, search->excluded_tags[i].tag);
+	}
+	search_cache_add_expr_deps(entry, search->groups);
+	for (unsigned int i = 0; i < search->of_orders; i++) {
+		const order_t *order = &search->orders[i];
+		if (order->simple == ORDER_TAGCOUNT
+		    || order->simple == ORDER_MD5
+		   ) {
+			entry->all_posts = 1;
+		} else if (!order->simple) {
+			search_cache_add_dep(entry, order->tag);
 		}
-		data->tag_len = new_len;
 	}
-	data->tag[data->tag_pos++] = tag;
+	entry->used = ++search_cache_clock;
+	entry->in_use = 1;
+	entry->sorted = sorted;
+	search_cache_mem += z;
 }
 
-static void tag_search_i(const char *name, const tag_t *tag,
-                         int check_dup, tag_search_data_t *data)
+/* Value orders compare keys extracted once per post into a sort_rec_t, *
+ * instead of looking the values up in every comparison.               */
+typedef union sort_value {
+	int64_t           v_int;
+	uint64_t          v_uint;
+	double            v_double;
+	const char        *v_str;
+	const tag_value_t *v_tv;
+} sort_value_t;
+
+/* have[i] is 0 if the post lacks the tag, 1 for a null value, 2 otherwise. */
+typedef struct sort_rec {
+	post_t       *post;
+	sort_value_t val[PROT_ORDERS_PER_SEARCH];
+	uint8_t      have[PROT_ORDERS_PER_SEARCH];
+} sort_rec_t;
+
+static void sort_value_set(sort_key_kind_t kind, sort_value_t *v,
+                           const tag_value_t *tv)
 {
-	if (data->error) return;
-	if (data->type == 'P') {
-		if (strstr(name, data->text)) {
-			tag_search_add_res(data, tag, check_dup);
-		}
-	} else {
-		int nlen = strlen(name);
-		if ((nlen == data->tlen
-		     || (nlen > data->tlen && data->type == 'I')
-		    ) && !memcmp(name, data->text, data->tlen)
-		   ) {
-			tag_search_add_res(data, tag, check_dup);
-		}
+	switch (kind) {
+		case SORT_KEY_INT:
+			v->v_int = tv->val.v_int;
+			break;
+		case SORT_KEY_UINT:
+			v->v_uint = tv->val.v_uint;
+			break;
+		case SORT_KEY_DOUBLE:
+			v->v_double = tv->val.v_double;
+			break;
+		case SORT_KEY_DATETIME:
+			v->v_int = dt_make_simple(&tv->val.v_datetime);
+			break;
+		case SORT_KEY_STR:
+			v->v_str = tv->v_str;
+			break;
+		default:
+			v->v_tv = tv;
+			break;
 	}
 }
 
-static void tag_search_P(ss128_key_t key, ss128_value_t value, void *data_)
+static int sort_value_is_null(sort_key_kind_t kind, const tag_value_t *tv)
 {
-	tag_search_data_t *data = data_;
-	const tag_t       *tag = (const tag_t *)value;
-	const char *name = data->fuzzy ? tag->fuzzy_name : tag->name;
-	(void)key;
-	tag_search_i(name, tag, 0, data);
+	return tv->v_str == tag_value_null_marker
+	       && (kind == SORT_KEY_INT
+	           || kind == SORT_KEY_UINT
+	           || kind == SORT_KEY_DOUBLE);
 }
 
-static void tag_search_P_alias(ss128_key_t key, ss128_value_t value,
-                               void *data_)
+static void sort_rec_fill(const search_t *search, sort_rec_t *rec, post_t *post)
 {
-	tag_search_data_t *data = data_;
-	const tagalias_t  *tagalias = (const tagalias_t *)value;
-	const char *name = data->fuzzy ? tagalias->fuzzy_name : tagalias->name;
+	rec->post = post;
+	for (unsigned int i = 0; i < search->of_orders; i++) {
+		const order_t *order = &search->orders[i];
+		if (order->simple) continue;
+		const tag_value_t *tv = post_column_value(post, order->tag);
+		rec->have[i] = 2;
+		if (!tv) {
+			rec->have[i] = 0;
+		} else if (sort_value_is_null(order->kind, tv)) {
+			rec->have[i] = 1;
+		} else {
+			sort_value_set(order->kind, &rec->val[i], tv);
+		}
+	}
+}
+
+#define SORT_CMP(a, b) ((a) < (b) ? -1 : (a) > (b))
+static int sorter_rec(const void *_r1, const void *_r2, void *_search)
+{
+	const sort_rec_t *r1 = *(const sort_rec_t * const *)_r1;
+	const sort_rec_t *r2 = *(const sort_rec_t * const *)_r2;
+	search_t         *search = _search;
+
+	search->prof.cmps++;
+	for (unsigned int i = 0; i < search->of_orders; i++) {
+		order_t *order = &search->orders[i];
+		const sort_value_t *v1 = &r1->val[i];
+		const sort_value_t *v2 = &r2->val[i];
+		int r;
+
+		if (order->simple) {
+			r = sorters[order->simple - 1](r1->post, r2->post);
+		} else if (r1->have[i] != 2 || r2->have[i] != 2) {
+			r = SORT_CMP(r1->have[i], r2->have[i]);
+		} else {
+			switch (order->kind) {
+				case SORT_KEY_INT:
+				case SORT_KEY_DATETIME:
+					r = SORT_CMP(v1->v_int, v2->v_int);
+					break;
+				case SORT_KEY_UINT:
+					r = SORT_CMP(v1->v_uint, v2->v_uint);
+					break;
+				case SORT_KEY_DOUBLE:
+					r = SORT_CMP(v1->v_double, v2->v_double);
+					break;
+				case SORT_KEY_STR:
+					r = strcmp(v1->v_str, v2->v_str);
+					break;
+				default:
+					r = order->cmp(v1->v_tv, CMP_CMP, v2->v_tv, 0);
+					break;
+			}
+		}
+		if (r) return r * order->sign;
+	}
+	return 0;
+}
+
+/* Radix key of a value, monotone in it (strings only by their first 8 *
+ * bytes). Keys only need to agree with the first order, ties are      *
+ * sorted on the full comparison afterwards.                           */
+static uint64_t sort_value_key(sort_key_kind_t kind, const sort_value_t *v)
+{
+	uint64_t key = 0;
+
+	switch (kind) {
+		case SORT_KEY_INT:
+		case SORT_KEY_DATETIME:
+			key = (uint64_t)v->v_int ^ (1ULL << 63);
+			break;
+		case SORT_KEY_UINT:
+			key = v->v_uint;
+			break;
+		case SORT_KEY_DOUBLE:
+			key = double_key(v->v_double);
+			break;
+		case SORT_KEY_STR:
+			for (int i = 0, end = 0; i < 8; i++) {
+				if (!end && !v->v_str[i]) end = 1;
+				key = key << 8;
+				if (!end) key |= (uint8_t)v->v_str[i];
+			}
+			break;
+		default:
+			break;
+	}
+	return key;
+}
+
+static uint64_t order_key(const order_t *order, const post_t *post,
+                          const sort_rec_t *rec)
+{
+	uint64_t key = 0;
+
+	if (order->simple == ORDER_TAGCOUNT) {
+		key = post->of_tags;
+	} else if (order->simple == ORDER_MD5) {
+		for (int i = 0; i < 8; i++) key = key << 8 | post->md5.m[i];
+	} else if (rec->have[0] == 2) {
+		key = sort_value_key(order->kind, &rec->val[0]);
+	}
+	return order->sign < 0 ? ~key : key;
+}
+
+static uint64_t sorter_key(const void *_p, void *_search)
+{
+	const post_t *p = *(const post_t * const *)_p;
+	return order_key(&((search_t *)_search)->orders[0], p, NULL);
+}
+
+static uint64_t sorter_rec_key(const void *_r, void *_search)
+{
+	const sort_rec_t *r = *(const sort_rec_t * const *)_r;
+	return order_key(&((search_t *)_search)->orders[0], r->post, r);
+}
+
+/* Planner statistics for value comparisons: an equi-depth histogram of *
+ * the sort keys of a sample of the values of a tag, and how many are   *
+ * distinct. Rebuilt when the post count of the tag has moved by more   *
+ * than 1/8 or its value type changed, so they may be a little stale,   *
+ * which is fine for estimates.                                         */
+#define STATS_BUCKETS 16
+#define STATS_SAMPLE  4096
+
+typedef struct tag_stats {
+	uint32_t        count;      // posts + weak posts when built
+	uint32_t        of_sampled;
+	uint32_t        of_values;  // sampled posts with a (not null) value
+	uint32_t        distinct;   // distinct keys among those
+	sort_key_kind_t kind;
+	uint64_t        bounds[STATS_BUCKETS + 1];
+} tag_stats_t;
+
+static ss128_head_t tag_stats_tree;
+static int          tag_stats_inited = 0;
+
+static void tag_stats_init(void)
+{
+	if (tag_stats_inited) return;
+	ss128_init(&tag_stats_tree, ss128_heap_alloc, ss128_heap_free, NULL);
+	tag_stats_inited = 1;
+}
+
+void tag_stats_forget(const tag_t *tag)
+{
+	ss128_value_t v;
+	tag_stats_init();
+	if (ss128_find(&tag_stats_tree, &v, tag->guid.key)) return;
+	ss128_delete(&tag_stats_tree, tag->guid.key);
+	free(v);
+}
+
+static int sort_stats_key(const void *_k1, const void *_k2, void *data)
+{
+	const uint64_t k1 = *(const uint64_t *)_k1;
+	const uint64_t k2 = *(const uint64_t *)_k2;
+	(void) data;
+	return SORT_CMP(k1, k2);
+}
+
+static void tag_stats_build(const tag_t *tag, tag_stats_t *st,
+                            uint64_t *keys)
+{
+	const post_list_t *lists[] = {&tag->posts, &tag->weak_posts};
+	const sort_key_kind_t kind = sort_key_kinds[tag->valuetype];
+	uint32_t step, i = 0, n = 0;
+
+	st->count = tag->posts.count + tag->weak_posts.count;
+	st->kind = kind;
+	st->of_sampled = 0;
+	step = st->count / STATS_SAMPLE + 1;
+	for (int l = 0; l < 2; l++) {
+		const post_node_t *pn;
+		for (pn = lists[l]->head; pn; pn = pn->succ, i++) {
+			if (i % step) continue;
+			const tag_value_t *tv = post_tag_value(pn->post, tag);
+			sort_value_t v;
+			st->of_sampled++;
+			if (!tv || tv->v_str == tag_value_null_marker) continue;
+			sort_value_set(kind, &v, tv);
+			keys[n++] = sort_value_key(kind, &v);
+		}
+	}
+	st->of_values = n;
+	st->distinct = 0;
+	if (!n) return;
+	sort(keys, n, sizeof(*keys), sort_stats_key, NULL);
+	for (i = 0; i < n; i++) {
+		if (!i || keys[i] != keys[i - 1]) st->distinct++;
+	}
+	for (i = 0; i <= STATS_BUCKETS; i++) {
+		st->bounds[i] = keys[(uint64_t)i * (n - 1) / STATS_BUCKETS];
+	}
+}
+
+static const tag_stats_t *tag_stats(const tag_t *tag)
+{
+	const uint32_t count = tag->posts.count + tag->weak_posts.count;
+	ss128_value_t  v;
+	tag_stats_t    *st;
+	uint64_t       *keys;
+
+	tag_stats_init();
+	if (!ss128_find(&tag_stats_tree, &v, tag->guid.key)) {
+		st = v;
+		uint32_t drift = count > st->count ? count - st->count
+		                                   : st->count - count;
+		if (st->kind == sort_key_kinds[tag->valuetype]
+		    && drift <= st->count / 8
+		   ) {
+			return st;
+		}
+	} else {
+		st = NULL;
+	}
+	keys = malloc(STATS_SAMPLE * sizeof(*keys));
+	if (!keys) return NULL;
+	if (!st) {
+		// Nothing can fail after the insert, so st is always built.
+		st = malloc(sizeof(*st));
+		if (!st || ss128_insert(&tag_stats_tree, st, tag->guid.key)) {
+			free(st);
+			free(keys);
+			return NULL;
+		}
+	}
+	tag_stats_build(tag, st, keys);
+	free(keys);
+	return st;
+}
+
+/* The fraction of the sampled values with a key below key. */
+static double tag_stats_below(const tag_stats_t *st, uint64_t key)
+{
+	const uint64_t *b = st->bounds;
+	if (key <= b[0]) return 0.0;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		if (key <= b[i + 1]) {
+			double part = (double)(key - b[i]) / (double)(b[i + 1] - b[i]);
+			return (i + part) / STATS_BUCKETS;
+		}
+	}
+	return 1.0;
+}
+
+/* The search planner orders the tags of a search by estimated cost, in *
+ * rough units of one step along a posting list.                        */
+#define PLAN_HAS_COST    8    // post_has_tag
+#define PLAN_TV_COST     4    // a value comparison
+#define PLAN_PROBE_COST  2    // a hash set lookup
+#define PLAN_REGEXP_SEL  0.1  // guessed share matching a regexp or words
+#define PLAN_DEFAULT_SEL 0.25 // and other comparisons without stats
+
+/* The share of the posts with the tag that also match the value. */
+static double plan_selectivity(const search_tag_t *t)
+{
+	const sort_key_kind_t kind = sort_key_kinds[t->tag->valuetype];
+	const tag_stats_t     *st;
+	sort_value_t          v;
+	double                valued, below, eq, sel;
+
+	if (!t->cmp) return 1.0;
+	if (t->cmp == CMP_REGEXP || t->cmp == CMP_WORDS) {
+		return PLAN_REGEXP_SEL;
+	}
+	st = tag_stats(t->tag);
+	if (!st || !st->of_sampled) return PLAN_DEFAULT_SEL;
+	valued = (double)st->of_values / st->of_sampled;
+	if (t->val.v_str == tag_value_null_marker) return 1.0 - valued;
+	if (kind == SORT_KEY_TV || !st->of_values) {
+		return valued * PLAN_DEFAULT_SEL;
+	}
+	sort_value_set(kind, &v, &t->val);
+	below = tag_stats_below(st, sort_value_key(kind, &v));
+	eq = 1.0 / st->distinct;
+	switch (t->cmp) {
+		case CMP_EQ:
+			sel = eq;
+			break;
+		case CMP_GT:
+			sel = 1.0 - below - eq;
+			break;
+		case CMP_GE:
+			sel = 1.0 - below;
+			break;
+		case CMP_LT:
+			sel = below;
+			break;
+		case CMP_LE:
+			sel = below + eq;
+			break;
+		default:
+			sel = PLAN_DEFAULT_SEL;
+			break;
+	}
+	if (sel < eq) sel = eq;
+	if (sel > 1.0) sel = 1.0;
+	return valued * sel;
+}
+
+/* Expected number of posts matching t. */
+static double plan_estimate(const search_tag_t *t)
+{
+	return tag_count(t->tag, t->weak, NULL) * plan_selectivity(t);
+}
+
+/* Excluded tags are removed with an anti-join (result_remove_list) when *
+ * walking their lists is cheaper than post_has_tag on every post.      */
+static int plan_anti_join(const search_tag_t *t, uint32_t of_posts)
+{
+	double walk = tag_count(t->tag, t->weak, NULL);
+	if (t->cmp) walk *= 1 + PLAN_TV_COST;
+	return walk + (double)of_posts * PLAN_PROBE_COST
+	       < (double)of_posts * PLAN_HAS_COST;
+}
+
+typedef struct plan_tag {
+	search_tag_t t;
+	double       estimate;
+	double       walk; // cost of seeding with it
+	double       step; // cost per post of intersecting with it
+} plan_tag_t;
+
+static int sort_plan_tag(const void *_p1, const void *_p2, void *data)
+{
+	const plan_tag_t *p1 = _p1;
+	const plan_tag_t *p2 = _p2;
+	const int sign = data ? -1 : 1;
+	return sign * SORT_CMP(p1->estimate, p2->estimate);
+}
+
+/* Picks the seed (the tag whose list is walked) that makes the search  *
+ * cheapest, and intersects the rest most selective first. Excluded     *
+ * tags are ordered to remove the most posts first. Positive tags are   *
+ * left alone with group ordering, which depends on the first tag.      */
+static void plan_search(search_t *search, int can_reorder)
+{
+	plan_tag_t   plan[PROT_TAGS_PER_SEARCH];
+	double       total = magic_tag[0]->posts.count; // all posts have it
+	double       best_cost = 0;
+	unsigned int best = 0;
+	unsigned int i, j;
+
+	if (total < 1) total = 1;
+	if (can_reorder && search->of_tags > 1) {
+		for (i = 0; i < search->of_tags; i++) {
+			plan_tag_t *p = &plan[i];
+			p->t        = search->tags[i];
+			p->estimate = plan_estimate(&p->t);
+			p->walk     = tag_count(p->t.tag, p->t.weak, NULL);
+			p->step     = PLAN_HAS_COST;
+			if (p->t.cmp) {
+				p->step += PLAN_TV_COST;
+				// With an index only the candidates are walked
+				if (value_index_usable(p->t.tag, p->t.cmp,
+				                       &p->t.val)
+				   ) {
+					p->walk = p->estimate;
+				}
+				p->walk *= 1 + PLAN_TV_COST;
+			}
+		}
+		sort(plan, search->of_tags, sizeof(*plan), sort_plan_tag, NULL);
+		for (i = 0; i < search->of_tags; i++) {
+			double cost = plan[i].walk;
+			double size = plan[i].estimate;
+			for (j = 0; j < search->of_tags; j++) {
+				if (j == i) continue;
+				cost += size * plan[j].step;
+				size *= plan[j].estimate / total;
+			}
+			if (!i || cost < best_cost) {
+				best_cost = cost;
+				best = i;
+			}
+		}
+		search->tags[0] = plan[best].t;
+		for (i = 0, j = 1; i < search->of_tags; i++) {
+			if (i != best) search->tags[j++] = plan[i].t;
+		}
+	}
+	if (search->of_excluded_tags > 1) {
+		for (i = 0; i < search->of_excluded_tags; i++) {
+			plan[i].t = search->excluded_tags[i];
+			plan[i].estimate = plan_estimate(&plan[i].t);
+		}
+		sort(plan, search->of_excluded_tags, sizeof(*plan), sort_plan_tag,
+		     plan);
+		for (i = 0; i < search->of_excluded_tags; i++) {
+			search->excluded_tags[i] = plan[i].t;
+		}
+	}
+}
+
+static int setup_search(search_t *search)
+{
+	/* Group ordering is implicit in match order. */
+	for (unsigned int i = 0; i < search->of_orders; i++) {
+		if (search->orders[i].simple == ORDER_GROUP) search->list_order = 1;
+	}
+	if (!search->of_tags && !search->of_excluded_tags && !search->post) {
+		return 0;
+	}
+	plan_search(search, !search->list_order);
+	return 0;
+}
+
+/* Sort [start, end) of the result, or all of it. */
+static void search_sort(search_t *search, result_t *result, long start,
+                        long end)
+{
+	long           n = result->of_posts;
+	void           *base = result->posts;
+	sort_compar_t  comp = sorter;
+	sort_key_t     key = sorter_key;
+	sort_rec_t     *recs = NULL;
+	sort_rec_t     **ptrs = NULL;
+	int            values = 0;
+
+	if (start >= end) return;
+	for (unsigned int i = 0; i < search->of_orders; i++) {
+		if (!search->orders[i].simple) values = 1;
+	}
+	if (values) {
+		recs = malloc(n * sizeof(*recs));
+		ptrs = malloc(n * sizeof(*ptrs));
+		if (recs && ptrs) {
+			for (long i = 0; i < n; i++) {
+				sort_rec_fill(search, &recs[i], result->posts[i]);
+				ptrs[i] = &recs[i];
+			}
+			base = ptrs;
+			comp = sorter_rec;
+			key = sorter_rec_key;
+		}
+	}
+	const order_t *first = &search->orders[0];
+	if (start > 0 || end < n) {
+		sort_partial(base, n, start, end, sizeof(void *), comp, search);
+		search->prof.sort = "partial";
+	} else if (search->of_orders && n >= SEARCH_RADIX_MIN
+	           && (first->simple ? first->simple != ORDER_GROUP
+	                             : base == ptrs && first->kind != SORT_KEY_TV)
+	          ) {
+		sort_radix(base, n, sizeof(void *), key, comp, search);
+		search->prof.sort = "radix";
+	} else {
+		sort(base, n, sizeof(void *), comp, search);
+		search->prof.sort = "merge";
+	}
+	if (base == ptrs) {
+		for (long i = start; i < end; i++) {
+			result->posts[i] = ptrs[i]->post;
+		}
+	}
+	free(recs);
+	free(ptrs);
+}
+
+/* When only a small window of a large result is returned, only that *
+ * window needs to be sorted. Not for cursors, which keep the whole   *
+ * sorted result, or ranges around a specific post.                  */
+static int search_sort_partial(const search_t *search, const result_t *result,
+                               long *r_start, long *r_end)
+{
+	long n = result->of_posts;
+	long start = search->range_start;
+	long end = search->range_end + 1;
+
+	if (search->post || search->cursor || start < 0) return 0;
+	if (end > n) end = n;
+	if (start < end && (end - start) * 8 > n) return 0;
+	*r_start = start;
+	*r_end = end;
+	return 1;
+}
+
+/* Evaluates expr to a set sorted by post pointer, remembered in *
+ * search->memo (which owns it).                                 */
+static const result_t *expr_eval(connection_t *conn, search_t *search,
+                                 search_expr_t *expr)
+{
+	expr_memo_t *memo;
+	result_t    res;
+
+	for (memo = search->memo; memo; memo = memo->next) {
+		if (!memcmp(&memo->key, &expr->key, sizeof(expr->key))) {
+			return &memo->result;
+		}
+	}
+	memset(&res, 0, sizeof(res));
+	if (expr->type == EXPR_TAG) {
+		if (result_intersect(conn, &res, &expr->tag, 0)) goto err;
+		result_sort_set(&res);
+	} else if (expr->type == EXPR_OR) {
+		for (search_expr_t *e = expr->child; e; e = e->next) {
+			const result_t *sub = expr_eval(conn, search, e);
+			result_t merged;
+			if (!sub) goto err;
+			if (result_merge_sets(conn, &merged, &res, sub, 0)) {
+				goto err;
+			}
+			result_free(conn, &res);
+			res = merged;
+		}
+	} else { // EXPR_AND
+		int have = 0;
+		for (search_expr_t *e = expr->child; e; e = e->next) {
+			if (e->type == EXPR_NOT_TAG) continue;
+			const result_t *sub = expr_eval(conn, search, e);
+			result_t merged;
+			if (!sub) goto err;
+			if (result_merge_sets(conn, &merged, have ? &res : sub,
+			                      sub, 1)) {
+				goto err;
+			}
+			result_free(conn, &res);
+			res = merged;
+			have = 1;
+			if (!res.of_posts) break;
+		}
+		if (!have) { // Only exclusions, start with all posts
+			post2result_data_t data;
+			data.conn   = conn;
+			data.result = &res;
+			data.error  = 0;
+			ss128_iterate(posts, post2result, &data);
+			if (data.error) goto err;
+			result_sort_set(&res);
+		}
+		for (search_expr_t *e = expr->child; e; e = e->next) {
+			if (e->type != EXPR_NOT_TAG || !res.of_posts) continue;
+			if (result_remove_tag(conn, &res, &e->tag)) goto err;
+		}
+	}
+	if (c_alloc(conn, (void **)&memo, sizeof(*memo))) goto err;
+	memo->key    = expr->key;
+	memo->result = res;
+	memo->next   = search->memo;
+	search->memo = memo;
+	return &memo->result;
+err:
+	result_free(conn, &res);
+	return NULL;
+}
+
+/* ANDs the groups into result, or starts it from the first group *
+ * if there were no positive tags.                                */
+static int search_groups(connection_t *conn, search_t *search,
+                         result_t *result)
+{
+	for (search_expr_t *group = search->groups; group; group = group->next) {
+		const result_t *set = expr_eval(conn, search, group);
+		if (!set) return 1;
+		if (group == search->groups && !search->of_tags) {
+			result_t copy;
+			if (result_merge_sets(conn, &copy, set, set, 1)) return 1;
+			*result = copy;
+		} else if (result_filter_set(conn, result, set)) {
+			return 1;
+		}
+		profile_step(search, "group", NULL, result->of_posts);
+		if (!result->of_posts) break;
+	}
+	return 0;
+}
+
+/* Ranked searches only keep as many posts as the range can show. */
+static uint32_t search_rank_k(const search_t *search)
+{
+	if (search->range_start < 0 || search->cursor
+	    || (search->flags & FLAG(FLAG_COUNT_ONLY))
+	    || search->range_end >= UINT32_MAX
+	   ) {
+		return UINT32_MAX;
+	}
+	return search->range_end + 1;
+}
+
+static void do_search(connection_t *conn, search_t *search, result_t *result)
+{
+	ss128_key_t key;
+	int         r = 0, sorted = 0;
+	long        start, end;
+
+	memset(result, 0, sizeof(*result));
+	search->prof.tv_start = tv_evaluations;
+	profile_phase(search, PHASE_INTERSECT);
+	if (search->of_ranked && search->of_orders) {
+		conn->error(conn, "E mutually exclusive options specified");
+		goto err;
+	}
+	if (search->post) {
+		if (search->of_tags || search->of_excluded_tags
+		    || search->groups || search->of_ranked
+		   ) {
+			conn->error(conn, "E mutually exclusive options specified");
+			goto err;
+		}
+		if (search->post != &null_post) {
+			err1(result_add_post(conn, result, search->post));
+		}
+		profile_step(search, "post", NULL, result->of_posts);
+		goto done;
+	}
+	key = search_key(search);
+	if (!search->of_ranked) r = search_cache_get(conn, key, result, &sorted);
+	if (r < 0) {
+		c_close_error(conn, E_MEM);
+		goto err;
+	}
+	if (r) {
+		profile_step(search, "cache", NULL, result->of_posts);
+		if (sorted) goto cached;
+		goto done;
+	}
+	for (unsigned int i = 0; i < search->of_tags; i++) {
+		if (result_intersect(conn, result, &search->tags[i],
+		                     search->list_order)
+		   ) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		profile_step(search, i ? "intersect" : "seed", &search->tags[i],
+		             result->of_posts);
+		if (!result->of_posts) goto done;
+	}
+	if (search->groups) {
+		if (search_groups(conn, search, result)) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		if (!result->of_posts) goto done;
+	}
+	if (!result->of_posts && search->of_ranked) { // Walk the W tags instead
+		profile_phase(search, PHASE_SORT);
+		if (result_rank(conn, result, search->ranked, search->of_ranked,
+		                search->excluded_tags, search->of_excluded_tags,
+		                search_rank_k(search))) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		profile_step(search, "rank", NULL, result->of_posts);
+		goto ranked;
+	}
+	if (!result->of_posts) { // No positive criteria -> start with all posts
+		post2result_data_t data;
+		data.conn   = conn;
+		data.result = result;
+		data.error  = 0;
+		ss128_iterate(posts, post2result, &data);
+		if (data.error) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		profile_step(search, "all", NULL, result->of_posts);
+	}
+	profile_phase(search, PHASE_EXCLUDE);
+	for (unsigned int i = 0; i < search->of_excluded_tags; i++) {
+		search_tag_t *t = &search->excluded_tags[i];
+		const int anti_join = plan_anti_join(t, result->of_posts);
+		int failed;
+		if (anti_join) {
+			failed = result_remove_list(conn, result, t);
+		} else {
+			failed = result_remove_tag(conn, result, t);
+		}
+		if (failed) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		profile_step(search, anti_join ? "antijoin" : "filter", t,
+		             result->of_posts);
+		if (!result->of_posts) goto done;
+	}
+	if (search->of_ranked) {
+		profile_phase(search, PHASE_SORT);
+		if (result_rank(conn, result, search->ranked, search->of_ranked,
+		                NULL, 0, search_rank_k(search))) {
+			c_close_error(conn, E_MEM);
+			goto err;
+		}
+		profile_step(search, "rank", NULL, result->of_posts);
+		goto ranked;
+	}
+done:
+	profile_phase(search, PHASE_SORT);
+	if (result->of_posts > 1
+	    && search_sort_partial(search, result, &start, &end)
+	   ) {
+		if (!r) search_cache_put(search, key, result, 0);
+		search_sort(search, result, start, end);
+		goto partial;
+	}
+	if (result->of_posts > 1) search_sort(search, result, 0, result->of_posts);
+	if (!search->post && !search->of_ranked) {
+		search_cache_put(search, key, result, 1);
+	}
+cached:
+partial:
+ranked:;
+	long pos = 0;
+	if (search->range_start < -1) {
+		for (pos = 0; pos < (long)result->of_posts; pos++) {
+			const post_t *post = result->posts[pos];
+			if (!memcmp(&post->md5, &search->range_md5, sizeof(md5_t))) {
+				pos++;
+				break;
+			}
+		}
+	}
+	search_set_range(search, result->of_posts, pos);
+	return;
+err:
+	search->failed = 1;
+}
+
+/* Unordered searches stream posts straight from result_walk, and stop *
+ * once the range is done if the count is known up front. Otherwise    *
+ * the window is kept while counting the rest.                         */
+#define STREAM_WINDOW_MAX 4096
+
+typedef struct stream_data {
+	connection_t *conn;
+	search_t     *search;
+	long         pos;
+	post_t       **window;
+	int          keep; // keep the window and count everything
+} stream_data_t;
+
+static int stream_post(post_t *post, void *data_)
+{
+	stream_data_t *data = data_;
+	search_t *search = data->search;
+	long pos = data->pos++;
+
+	if (pos < search->range_start || pos >= search->range_end) {
+		return data->keep ? 0 : pos >= search->range_end;
+	}
+	if (data->keep) {
+		data->window[pos - search->range_start] = post;
+	} else {
+		return_post(data->conn, post, search->flags);
+	}
+	return 0;
+}
+
+/* Returns 1 if the search can not be streamed, 0 if it was handled. */
+static int stream_search(connection_t *conn, search_t *search)
+{
+	stream_data_t data;
+	uint32_t      count;
+	int           quick;
+	const int     ranged = (search->range_start != -1);
+
+	if (search->post || search->of_orders || search->cursor
+	    || search->groups || search->of_ranked || search->range_start < -1
+	    || (search->flags & FLAG(FLAG_PROFILE))
+	   ) {
+		return 1;
+	}
+	quick = !result_quick_count(search->tags, search->of_tags,
+	                            search->of_excluded_tags, &count);
+	data.conn   = conn;
+	data.search = search;
+	data.pos    = 0;
+	data.window = NULL;
+	data.keep   = ranged && !quick;
+	if (data.keep) {
+		long z = search->range_end + 1 - search->range_start;
+		if (z > STREAM_WINDOW_MAX) return 1;
+		if (z > 0 && c_alloc(conn, (void **)&data.window,
+		                     z * sizeof(post_t *))) {
+			c_close_error(conn, E_MEM);
+			return 0;
+		}
+	}
+	if (ranged) {
+		search->range_end++;
+		if (quick) {
+			c_printf(conn, "RR%x:%lx\n", count, search->range_start);
+		}
+	} else {
+		search->range_start = 0;
+		search->range_end = LONG_MAX;
+	}
+	if (result_walk(search->tags, search->of_tags, search->excluded_tags,
+	                search->of_excluded_tags, search->list_order,
+	                stream_post, &data)
+	   ) {
+		c_close_error(conn, E_MEM);
+		return 0;
+	}
+	if (data.keep) {
+		c_printf(conn, "RR%x:%lx\n", (uint32_t)data.pos,
+		         search->range_start);
+		long end = data.pos < search->range_end ? data.pos
+		                                        : search->range_end;
+		for (long i = search->range_start; i < end; i++) {
+			return_post(conn, data.window[i - search->range_start],
+			            search->flags);
+		}
+	}
+	c_printf(conn, "OK\n");
+	return 0;
+}
+
+/* Fcount: just the number of matches, found without a result_t. */
+static void count_search(connection_t *conn, search_t *search)
+{
+	uint32_t count = 0;
+	if (search->post) {
+		if (search->of_tags || search->of_excluded_tags
+		    || search->groups || search->of_ranked
+		   ) {
+			conn->error(conn, "E mutually exclusive options specified");
+			search->failed = 1;
+		}
+		count = (search->post != &null_post);
+	} else if (search->groups || search->of_ranked) {
+		result_t result;
+		do_search(conn, search, &result);
+		count = result.of_posts;
+		result_free(conn, &result);
+	} else if (result_count(search->tags, search->of_tags,
+	                        search->excluded_tags,
+	                        search->of_excluded_tags, &count)) {
+		c_close_error(conn, E_MEM);
+		search->failed = 1;
+	}
+	// Errors end in OK too, like print_search
+	if (!search->failed) c_printf(conn, "RR%x\n", count);
+	c_printf(conn, "OK\n");
+}
+
+static void print_search(connection_t *conn, search_t *search, result_t *result)
+{
+	if (search->flags & FLAG(FLAG_COUNT_ONLY)) {
+		if (!search->failed) {
+			c_printf(conn, "RR%x\n", result->of_posts);
+			profile_print(conn, search);
+		}
+		c_printf(conn, "OK\n");
+		return;
+	}
+	profile_phase(search, PHASE_RENDER);
+	if (search->range_used) c_printf(conn, "RR%x:%lx\n", result->of_posts, search->range_start);
+	if (result->of_posts && !search->failed) {
+		for (long i = search->range_start; i < search->range_end; i++) {
+			return_post(conn, result->posts[i], search->flags);
+		}
+	}
+	if (!search->failed) profile_print(conn, search);
+	c_printf(conn, "OK\n");
+}
+
+/* Cursors keep the sorted result of a search (SP .. C) so that more    *
+ * pages can be fetched with SC without searching again. They are kept *
+ * in LRU order, and dropped when idle for too long or when the total  *
+ * memory budget is exceeded. The result is a snapshot, later changes  *
+ * to which posts match are not reflected.                             */
+#define CURSOR_TTL       600
+#define CURSOR_MEM_MAX   (64 * 1024 * 1024)
+#define CURSOR_MAX_COUNT 256
+
+static cursor_list_t cursors = {NULL, NULL};
+static size_t        cursor_mem = 0;
+static unsigned int  cursor_count = 0;
+
+static size_t cursor_size(const cursor_node_t *cursor)
+{
+	size_t z = sizeof(*cursor) + cursor->of_posts * sizeof(post_t *);
+	if (cursor->by_md5) z += cursor->of_posts * sizeof(uint32_t);
+	return z;
+}
+
+static void cursor_drop(cursor_node_t *cursor)
+{
+	cursor_remove(&cursors, cursor);
+	cursor_mem -= cursor_size(cursor);
+	cursor_count--;
+	free(cursor->posts);
+	free(cursor->by_md5);
+	free(cursor);
+}
+
+static void cursor_expire(time_t now)
+{
+	while (cursors.head && cursors.head->used + CURSOR_TTL < now) {
+		cursor_drop(cursors.head);
+	}
+}
+
+static int cursor_new(connection_t *conn, search_t *search, result_t *result)
+{
+	size_t z = sizeof(cursor_node_t) + result->of_posts * sizeof(post_t *);
+	time_t now = time(NULL);
+
+	cursor_expire(now);
+	if (z > CURSOR_MEM_MAX) return conn->error(conn, "C");
+	while (cursors.head
+	       && (cursor_mem + z > CURSOR_MEM_MAX
+	           || cursor_count >= CURSOR_MAX_COUNT)
+	      ) {
+		cursor_drop(cursors.head);
+	}
+	cursor_node_t *cursor = calloc(1, sizeof(*cursor));
+	if (!cursor) return c_close_error(conn, E_MEM);
+	if (result->of_posts) {
+		cursor->posts = malloc(result->of_posts * sizeof(post_t *));
+		if (!cursor->posts) {
+			free(cursor);
+			return c_close_error(conn, E_MEM);
+		}
+		memcpy(cursor->posts, result->posts,
+		       result->of_posts * sizeof(post_t *));
+	}
+	cursor->conn     = conn;
+	cursor->of_posts = result->of_posts;
+	cursor->id       = conn->cursor_next++;
+	cursor->flags    = search->flags & ~(FLAG(FLAG_COUNT_ONLY)
+	                                     | FLAG(FLAG_PROFILE));
+	cursor->used     = now;
+	cursor_addtail(&cursors, cursor);
+	cursor_mem += z;
+	cursor_count++;
+	c_printf(conn, "RC%x\n", cursor->id);
+	return 0;
+}
+
+static cursor_node_t *cursor_find(connection_t *conn, const char *idstr,
+                                  char **r_end)
+{
+	char *end;
+	unsigned long id = strtoul(idstr, &end, 16);
+	time_t now = time(NULL);
+
+	if (end == idstr || (*end && *end != ' ')) return NULL;
+	if (*end) end++;
+	*r_end = end;
+	cursor_expire(now);
+	for (cursor_node_t *cursor = cursors.head; cursor; cursor = cursor->succ) {
+		if (cursor->conn == conn && cursor->id == id) {
+			cursor->used = now;
+			cursor_remove(&cursors, cursor);
+			cursor_addtail(&cursors, cursor);
+			return cursor;
+		}
+	}
+	return NULL;
+}
+
+static int sort_cursor_md5(const void *_p1, const void *_p2, void *_cursor)
+{
+	const cursor_node_t *cursor = _cursor;
+	const post_t *p1 = cursor->posts[*(const uint32_t *)_p1];
+	const post_t *p2 = cursor->posts[*(const uint32_t *)_p2];
+	return memcmp(p1->md5.m, p2->md5.m, sizeof(p1->md5.m));
+}
+
+/* Position (plus one) of md5 in the cursor, or of_posts if not there. *
+ * The md5 order is built the first time it is needed, within the same *
+ * memory budget as the cursors themselves. If it does not fit even    *
+ * with all other cursors dropped the posts are scanned instead.       */
+static long cursor_md5_pos(cursor_node_t *cursor, const md5_t *md5)
+{
+	const size_t z = cursor->of_posts * sizeof(uint32_t);
+	if (!cursor->by_md5 && cursor->of_posts) {
+		while (cursors.head != cursor && cursor_mem + z > CURSOR_MEM_MAX) {
+			cursor_drop(cursors.head);
+		}
+		if (cursor_mem + z > CURSOR_MEM_MAX) {
+			for (uint32_t i = 0; i < cursor->of_posts; i++) {
+				if (!memcmp(cursor->posts[i]->md5.m, md5->m,
+				            sizeof(md5->m))
+				   ) {
+					return i + 1;
+				}
+			}
+			return cursor->of_posts;
+		}
+		uint32_t *by_md5 = malloc(z);
+		if (!by_md5) return -1;
+		for (uint32_t i = 0; i < cursor->of_posts; i++) by_md5[i] = i;
+		cursor->by_md5 = by_md5;
+		sort(by_md5, cursor->of_posts, sizeof(uint32_t),
+		     sort_cursor_md5, cursor);
+		cursor_mem += z;
+	}
+	long lo = 0;
+	long hi = cursor->of_posts;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		uint32_t pos = cursor->by_md5[mid];
+		int r = memcmp(cursor->posts[pos]->md5.m, md5->m,
+		               sizeof(md5->m));
+		if (!r) return pos + 1;
+		if (r < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return cursor->of_posts;
+}
+
+static int cursor_page_cmd(connection_t *conn, char *cmd, void *search,
+                           prot_cmd_flag_t flags)
+{
+	if (*cmd != 'R' && *cmd != 'F') return c_close_error(conn, E_SYNTAX);
+	return build_search_cmd(conn, cmd, search, flags);
+}
+
+static void cursor_page(connection_t *conn, char *args)
+{
+	search_t      search;
+	result_t      result;
+	char          *end;
+	cursor_node_t *cursor = cursor_find(conn, args, &end);
+
+	if (!cursor) {
+		conn->error(conn, args);
+		return;
+	}
+	init_search(&search);
+	if (prot_cmd_loop(conn, end, &search, cursor_page_cmd, CMDFLAG_NONE)) {
+		return;
+	}
+	if (!search.flags) search.flags = cursor->flags;
+	long pos = 0;
+	if (search.range_start < -1) {
+		pos = cursor_md5_pos(cursor, &search.range_md5);
+		if (pos < 0) {
+			c_close_error(conn, E_MEM);
+			return;
+		}
+	}
+	search_set_range(&search, cursor->of_posts, pos);
+	result.posts    = cursor->posts;
+	result.of_posts = cursor->of_posts;
+	result.room     = cursor->of_posts;
+	print_search(conn, &search, &result);
+}
+
+static void cursor_close(connection_t *conn, char *args)
+{
+	char *end;
+	cursor_node_t *cursor = cursor_find(conn, args, &end);
+	if (!cursor || *end) {
+		conn->error(conn, args);
+		return;
+	}
+	cursor_drop(cursor);
+	c_printf(conn, "OK\n");
+}
+
+typedef struct c_print_alias {
+	connection_t *conn;
+	const tag_t  *tag;
+} c_print_alias_t;
+
+static void c_print_alias_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	c_print_alias_t *data = data_;
+	tagalias_t *tagalias = (tagalias_t *)value;
+	(void) key;
+	if (tagalias->tag == data->tag) {
+		c_putc(data->conn, 'A');
+		c_puts(data->conn, tagalias->name);
+		c_putc(data->conn, ' ');
+	}
+}
+
+/* Pre-rendered "Gguid Nname Ttype Vvaluetype" for each tag, so printing *
+ * search results is mostly memcpy. Entries are made on first use, and   *
+ * dropped by tag_render_forget whenever the tag is modified.            */
+typedef struct tag_render {
+	unsigned int gen;
+	unsigned int g_len;
+	unsigned int n_len;
+	unsigned int t_len;
+	unsigned int v_len;
+	char         data[];
+} tag_render_t;
+
+static ss128_head_t tag_renders;
+static int          tag_renders_inited = 0;
+static unsigned int tag_render_gen = 0;
+
+static void tag_render_init(void)
+{
+	if (tag_renders_inited) return;
+	ss128_init(&tag_renders, ss128_heap_alloc, ss128_heap_free, NULL);
+	tag_renders_inited = 1;
+}
+
+void tag_render_forget(const tag_t *tag)
+{
+	ss128_value_t v;
+	tag_render_init();
+	if (ss128_find(&tag_renders, &v, tag->guid.key)) return;
+	ss128_delete(&tag_renders, tag->guid.key);
+	free(v);
+}
+
+static const tag_render_t *tag_render(const tag_t *tag)
+{
+	ss128_value_t v;
+	tag_render_init();
+	if (!ss128_find(&tag_renders, &v, tag->guid.key)) return v;
+
+	const char   *guidstr = guid_guid2str(tag->guid);
+	const char   *typestr = tagtype_names[tag->type];
+	const char   *vtstr   = tag_value_types[tag->valuetype];
+	unsigned int g_len = strlen(guidstr) + 2;
+	unsigned int n_len = strlen(tag->name) + 2;
+	unsigned int t_len = strlen(typestr) + 2;
+	unsigned int v_len = tag->valuetype ? strlen(vtstr) + 1 : 0;
+	tag_render_t *tr = malloc(sizeof(*tr) + g_len + n_len + t_len + v_len);
+	if (!tr) return NULL;
+	tr->gen   = ++tag_render_gen;
+	tr->g_len = g_len;
+	tr->n_len = n_len;
+	tr->t_len = t_len;
+	tr->v_len = v_len;
+	char *ptr = tr->data;
+	*ptr++ = 'G';
+	memcpy(ptr, guidstr, g_len - 2);
+	ptr += g_len - 2;
+	*ptr++ = ' ';
+	*ptr++ = 'N';
+	memcpy(ptr, tag->name, n_len - 2);
+	ptr += n_len - 2;
+	*ptr++ = ' ';
+	*ptr++ = 'T';
+	memcpy(ptr, typestr, t_len - 2);
+	ptr += t_len - 2;
+	*ptr++ = ' ';
+	if (v_len) {
+		*ptr++ = 'V';
+		memcpy(ptr, vtstr, v_len - 1);
+	}
+	if (ss128_insert(&tag_renders, tr, tag->guid.key)) {
+		free(tr);
+		return NULL;
+	}
+	return tr;
+}
+
+/* Ftagdict: each tag gets a connection-local id, and its description is   *
+ * only sent the first time the connection sees it (or after it changed). */
+typedef struct tagdict_entry {
+	unsigned int id;
+	unsigned int gen;
+} tagdict_entry_t;
+
+static void c_print_tagdict(connection_t *conn, const tag_t *tag, post_t *post)
+{
+	const tag_render_t *tr = tag_render(tag);
+	tagdict_entry_t    *ent;
+	ss128_value_t      v;
+	int                describe = 1;
+
+	if (!tr) goto err;
+	if (!conn->tagdict.allocmem) {
+		ss128_init(&conn->tagdict, ss128_heap_alloc, ss128_heap_free,
+		           NULL);
+	}
+	if (ss128_find(&conn->tagdict, &v, tag->guid.key)) {
+		ent = malloc(sizeof(*ent));
+		if (!ent) goto err;
+		if (ss128_insert(&conn->tagdict, ent, tag->guid.key)) {
+			free(ent);
+			goto err;
+		}
+		ent->id = conn->tagdict_next++;
+	} else {
+		ent = v;
+		describe = (ent->gen != tr->gen);
+	}
+	ent->gen = tr->gen;
+	c_putc(conn, '#');
+	c_puthex(conn, ent->id);
+	if (tag->valuetype && post) {
+		tag_value_t *tv = post_column_value(post, tag);
+		if (tv) {
+			c_putc(conn, '=');
+			tv_printer[tag->valuetype](conn, tv);
+		}
+	}
+	c_putc(conn, ' ');
+	if (describe) {
+		c_write(conn, tr->data, tr->g_len + tr->n_len + tr->t_len);
+		if (tr->v_len) {
+			c_write(conn, tr->data + tr->g_len + tr->n_len
+			              + tr->t_len, tr->v_len);
+			c_putc(conn, ' ');
+		}
+		if (tag->ordered) c_write(conn, "Fordered ", 9);
+		if (tag->unsettable) c_write(conn, "Funsettable ", 12);
+		if (tag->datatag) c_write(conn, "Fdatatag ", 9);
+	}
+	return;
+err:
+	c_close_error(conn, E_MEM);
+}
+
+static void tagdict_free_entry(ss128_key_t key, ss128_value_t value,
+                               void *data)
+{
+	(void) key;
+	(void) data;
+	free(value);
+}
+
+void client_cleanup(connection_t *conn)
+{
+	cursor_node_t *cursor = cursors.head;
+	while (cursor) {
+		cursor_node_t *next = cursor->succ;
+		if (cursor->conn == conn) cursor_drop(cursor);
+		cursor = next;
+	}
+	if (!conn->tagdict.allocmem) return;
+	ss128_iterate(&conn->tagdict, tagdict_free_entry, NULL);
+	ss128_free(&conn->tagdict);
+}
+
+static void c_print_tag(connection_t *conn, const tag_t *tag, int flags,
+                        int aliases, taglimit_t *limits, post_t *post)
+{
+	if (!tag) return;
+	const tag_render_t *tr = tag_render(tag);
+	if (!tr) {
+		c_close_error(conn, E_MEM);
+		return;
+	}
+	const char *ptr = tr->data;
+	if (flags == ~0) c_putc(conn, 'R');
+	if (flags & FLAG(FLAG_RETURN_TAGIDS)) {
+		c_write(conn, ptr, tr->g_len);
+	}
+	ptr += tr->g_len;
+	if (flags & FLAG(FLAG_RETURN_TAGNAMES)) {
+		c_write(conn, ptr, tr->n_len);
+	}
+	ptr += tr->n_len;
+	if (aliases) {
+		c_print_alias_t data;
+		data.conn = conn;
+		data.tag  = tag;
+		ss128_iterate(tagaliases, c_print_alias_cb, &data);
+	}
+	if (flags & FLAG(FLAG_RETURN_TAGDATA)) {
+		int count, weak_count;
+		if (limits) {
+			ss128_value_t res;
+			if (ss128_find(&limits->tree, &res, tag->guid.key)) {
+				count = weak_count = 0;
+			} else {
+				taglimit_tag_t *tt = (taglimit_tag_t *)res;
+				count = tt->count[0];
+				weak_count = tt->count[1];
+			}
+		} else {
+			count = tag->posts.count;
+			weak_count = tag->weak_posts.count;
+		}
+		c_write(conn, ptr, tr->t_len);
+		ptr += tr->t_len;
+		if (tr->v_len) {
+			c_write(conn, ptr, tr->v_len);
+			if (post) {
+				tag_value_t *tv = post_column_value(post, tag);
+				if (tv) {
+					c_putc(conn, '=');
+					tv_printer[tag->valuetype](conn, tv);
+				}
+			}
+			c_putc(conn, ' ');
+		}
+		c_putc(conn, 'P');
+		c_puthex(conn, (unsigned int)count);
+		c_write(conn, " W", 2);
+		c_puthex(conn, (unsigned int)weak_count);
+		if (tag->ordered) c_write(conn, " Fordered", 9);
+		if (tag->unsettable) c_write(conn, " Funsettable", 12);
+		if (tag->datatag) c_write(conn, " Fdatatag", 9);
+		if (flags != ~0) c_putc(conn, ' ');
+	}
+	if (flags == ~0) c_putc(conn, '\n');
+}
+
+static void tag_search_add_res(tag_search_data_t *data, const tag_t *tag,
+                               int check_dup)
+{
+	if (data->error) return;
+	if (data->datatags == T_NO && tag->datatag) return;
+	if (data->datatags == T_YES && !tag->datatag) return;
+	if (data->limits) {
+		ss128_value_t v;
+		if (ss128_find(&data->limits->tree, &v, tag->guid.key)) return;
+	}
+	if (check_dup) {
+		// This is terrible inefficient
+		for (int i = 0; i < data->tag_pos; i++) {
+			if (data->tag[i] == tag) return;
+		}
+	}
+	if (data->tag_pos == data->tag_len) {
+		int old_len = data->tag_len;
+		int new_len = old_len ? old_len * 2 : 16;
+		int r;
+		data->tag = c_realloc(data->conn, data->tag,
+		                      sizeof(*data->tag) * old_len,
+		                      sizeof(*data->tag) * new_len, &r);
+		if (r) {
+			data->error = E_MEM;
+			return;
+		}
+		data->tag_len = new_len;
+	}
+	data->tag[data->tag_pos++] = tag;
+}
+
+static void tag_search_i(const char *name, const tag_t *tag,
+                         int check_dup, tag_search_data_t *data)
+{
+	if (data->error) return;
+	if (data->type == 'P') {
+		if (strstr(name, data->text)) {
+			tag_search_add_res(data, tag, check_dup);
+		}
+	} else {
+		int nlen = strlen(name);
+		if ((nlen == data->tlen
+		     || (nlen > data->tlen && data->type == 'I')
+		    ) && !memcmp(name, data->text, data->tlen)
+		   ) {
+			tag_search_add_res(data, tag, check_dup);
+		}
+	}
+}
+
+static void tag_search_P(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	tag_search_data_t *data = data_;
+	const tag_t       *tag = (const tag_t *)value;
+	const char *name = data->fuzzy ? tag->fuzzy_name : tag->name;
+	(void)key;
+	tag_search_i(name, tag, 0, data);
+}
+
+static void tag_search_P_alias(ss128_key_t key, ss128_value_t value,
+                               void *data_)
+{
+	tag_search_data_t *data = data_;
+	const tagalias_t  *tagalias = (const tagalias_t *)value;
+	const char *name = data->fuzzy ? tagalias->fuzzy_name : tagalias->name;
 	(void)key;
 	tag_search_i(name, tagalias->tag, 1, data);
 }
@@ -1014,6 +2732,7 @@ static const char *tv_cmp_str[] = {"",   // CMP_NONE
                                    "<",  // CMP_LT
                                    "<=", // CMP_LE
                                    "=~", // CMP_REGEXP
+                                   "=%", // CMP_WORDS
                                    "==", // CMP_CMP, can't actually appear
                                   };
 
@@ -1105,12 +2824,45 @@ static void list_print(connection_t *conn, const char * const *list)
 	}
 }
 
+typedef struct list_values_data {
+	connection_t  *conn;
+	tv_printer_t  *printer;
+} list_values_data_t;
+
+static void list_values_cb(tag_value_t *tv, unsigned int count, void *data_)
+{
+	list_values_data_t *data = data_;
+	c_printf(data->conn, "RV%x ", count);
+	data->printer(data->conn, tv);
+	c_putc(data->conn, '\n');
+}
+
+/* Distinct values of a word or string tag, with their post counts. */
+static void list_values(connection_t *conn, const char *cmd)
+{
+	list_values_data_t data;
+	const tag_t *tag = tag_find_guidstr(cmd);
+
+	if (!tag) goto err;
+	data.conn = conn;
+	data.printer = tv_printer[tag->valuetype];
+	if (value_index_distinct(tag, list_values_cb, &data)) goto err;
+	c_printf(conn, "OK\n");
+	return;
+err:
+	conn->error(conn, cmd);
+}
+
 static void list_cmd(connection_t *conn, const char *cmd)
 {
 	const metalist_t list[] = {{"tagtypes", tagtype_names},
 	                           {"ratings", rating_names},
 	                           {NULL, NULL}
 	                          };
+	if (!strncmp(cmd, "values ", 7)) {
+		list_values(conn, cmd + 7);
+		return;
+	}
 	for (const metalist_t *p = list; p->name; p++) {
 		if (!strcmp(p->name, cmd)) {
 			list_print(conn, p->list);
@@ -1136,6 +2888,7 @@ extern int connection_count;
 
 void client_handle(connection_t *conn, char *buf)
 {
+	regex_cache_trim();
 	switch (*buf) {
 		case 'S': // 'S'earch
 			if (buf[1] == 'P') {
@@ -1145,13 +2898,28 @@ void client_handle(connection_t *conn, char *buf)
 				                      build_search_cmd,
 				                      CMDFLAG_NONE);
 				if (!r) r = setup_search(&search);
-				if (!r) {
+				if (!r && (search.flags & FLAG(FLAG_COUNT_ONLY))
+				    && !(search.flags & FLAG(FLAG_PROFILE))
+				    && !search.cursor
+				   ) {
+					count_search(conn, &search);
+				} else if (!r && stream_search(conn, &search)) {
 					result_t result;
 					do_search(conn, &search, &result);
-					print_search(conn, &search, &result);
+					if (search.cursor && !search.failed) {
+						r = cursor_new(conn, &search,
+						               &result);
+					}
+					if (!r) print_search(conn, &search,
+					                     &result);
+					result_free(conn, &result);
 				}
 			} else if (buf[1] == 'T') {
 				tag_search(conn, buf + 2);
+			} else if (buf[1] == 'C') {
+				cursor_page(conn, buf + 2);
+			} else if (buf[1] == 'c') {
+				cursor_close(conn, buf + 2);
 			} else {
 				c_close_error(conn, E_COMMAND);
 			}
@@ -0,0 +1,119 @@
+#include "db.h"
+
+/* Columns of the values of the data tags (and score), indexed by the *
+ * ordinal of the post, with a bitmap of which posts have a value.     *
+ * Searches, sorting and return_post read values from here instead of *
+ * walking the taglist of every post, and the values of neighbouring  *
+ * posts are next to each other instead of all over the mm cache.    *
+ * Like the value indexes they are kept in memory, built the first    *
+ * time they are needed and then kept up to date by column_change,    *
+ * until the tag changes type.                                        */
+
+#define COLUMN_TAGS 9 // magic_tag[0] to score
+
+typedef struct column {
+	tag_value_t *values;
+	uint64_t    *present; // one bit per ordinal
+	uint32_t    size;     // ordinals allocated
+	int         built;
+} column_t;
+
+static column_t columns[COLUMN_TAGS];
+
+static column_t *column_find(const tag_t *tag)
+{
+	for (int i = 0; i < COLUMN_TAGS; i++) {
+		if (magic_tag[i] == tag) return &columns[i];
+	}
+	return NULL;
+}
+
+static int column_grow(column_t *col, uint32_t ordinal)
+{
+	uint32_t size = col->size ? col->size : 1024;
+	while (size <= ordinal) size *= 2;
+	if (size == col->size) return 0;
+	tag_value_t *values = realloc(col->values, size * sizeof(*values));
+	if (!values) return 1;
+	col->values = values;
+	uint64_t *present = realloc(col->present, size / 64 * sizeof(*present));
+	if (!present) return 1;
+	memset(present + col->size / 64, 0,
+	       (size - col->size) / 64 * sizeof(*present));
+	col->present = present;
+	col->size = size;
+	return 0;
+}
+
+static void column_free(column_t *col)
+{
+	free(col->values);
+	free(col->present);
+	memset(col, 0, sizeof(*col));
+}
+
+static int column_set(column_t *col, const post_t *post,
+                      const tag_value_t *value)
+{
+	const uint32_t ordinal = post->ordinal;
+	const uint64_t bit = 1ULL << (ordinal % 64);
+	if (!value) {
+		if (ordinal < col->size) col->present[ordinal / 64] &= ~bit;
+		return 0;
+	}
+	if (column_grow(col, ordinal)) return 1;
+	col->values[ordinal] = *value;
+	col->present[ordinal / 64] |= bit;
+	return 0;
+}
+
+static int column_build(column_t *col, const tag_t *tag)
+{
+	const post_list_t *lists[] = {&tag->posts, &tag->weak_posts};
+	if (column_grow(col, *post_ordinals)) goto err;
+	for (int l = 0; l < 2; l++) {
+		for (post_node_t *pn = lists[l]->head; pn; pn = pn->succ) {
+			if (column_set(col, pn->post,
+			               post_tag_value(pn->post, tag))
+			   ) {
+				goto err;
+			}
+		}
+	}
+	col->built = 1;
+	return 0;
+err:
+	column_free(col);
+	return 1;
+}
+
+/* Like post_tag_value, but from the column when tag has one. */
+tag_value_t *post_column_value(const post_t *post, const tag_t *tag)
+{
+	column_t *col = column_find(tag);
+	if (!col || (!col->built && column_build(col, tag))) {
+		return post_tag_value(post, tag);
+	}
+	const uint32_t ordinal = post->ordinal;
+	if (ordinal >= col->size) return NULL;
+	if (!(col->present[ordinal / 64] & (1ULL << (ordinal % 64)))) {
+		return NULL;
+	}
+	return &col->values[ordinal];
+}
+
+/* Called with the new value (or NULL) whenever the value of tag on *
+ * post changes.                                                    */
+void column_change(const tag_t *tag, const post_t *post,
+                   const tag_value_t *value)
+{
+	column_t *col = column_find(tag);
+	if (!col || !col->built) return;
+	if (column_set(col, post, value)) column_free(col);
+}
+
+void column_forget(const tag_t *tag)
+{
+	column_t *col = column_find(tag);
+	if (col) column_free(col);
+}
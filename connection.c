@@ -13,6 +13,19 @@ static const char *errors[] = {
 	"bad utf8 sequence",
 };
 
+/* Memory allocated through c_alloc only lives until the end of the current *
+ * command. Small allocations are carved out of a chain of chunks that is   *
+ * rewound by c_reset, so a search is mostly free of malloc calls. Large    *
+ * allocations are malloced separately and kept on mem_list.                */
+#define ARENA_CHUNK_SIZE  (256 * 1024)
+#define ARENA_LARGE       (ARENA_CHUNK_SIZE / 4)
+#define ARENA_KEEP_CHUNKS 4
+
+#define ARENA_SIZE(z) (((z) + MM_ALIGN - 1) & ~(MM_ALIGN - 1))
+#define ARENA_DATA(chunk) ((char *)((chunk) + 1))
+
+unsigned int c_mem_high = 0;
+
 int c_init(connection_t **res_conn, int sock, prot_err_func_t error)
 {
 	connection_t *conn;
@@ -22,6 +35,7 @@ int c_init(connection_t **res_conn, int sock, prot_err_func_t error)
 	memset(conn, 0, sizeof(*conn));
 	mem_newlist(&conn->mem_list);
 	conn->mem_used = sizeof(*conn);
+	conn->mem_high = conn->mem_used;
 	conn->sock  = sock;
 	conn->error = error;
 	conn->flags = CONNFLAG_GOING;
@@ -29,6 +43,17 @@ int c_init(connection_t **res_conn, int sock, prot_err_func_t error)
 	return 0;
 }
 
+static void c_free_large_all(connection_t *conn)
+{
+	mem_node_t *node = conn->mem_list.head;
+	while (node) {
+		mem_node_t *next = node->succ;
+		free(node);
+		node = next;
+	}
+	mem_newlist(&conn->mem_list);
+}
+
 void c_cleanup(connection_t *conn)
 {
 	if (conn->trans.flags & TRANSFLAG_GOING) {
@@ -37,73 +62,184 @@ void c_cleanup(connection_t *conn)
 	if (conn->trans.flags & TRANSFLAG_OUTER) {
 		log_trans_end_outer(conn);
 	}
-	mem_node_t *node = conn->mem_list.head;
-	while (node) {
-		mem_node_t *next = node->succ;
-		free(node);
-		node = next;
+	client_cleanup(conn);
+	c_free_large_all(conn);
+	mem_chunk_t *chunk = conn->arena;
+	while (chunk) {
+		mem_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
+	if (conn->mem_high > c_mem_high) c_mem_high = conn->mem_high;
 	free(conn);
 }
 
-int c_alloc(connection_t *conn, void **res, unsigned int size)
+/* Called after every command, releases everything allocated during it. */
+void c_reset(connection_t *conn)
+{
+	c_free_large_all(conn);
+	mem_chunk_t *chunk = conn->arena;
+	for (int i = 1; chunk && i < ARENA_KEEP_CHUNKS; i++) {
+		chunk = chunk->next;
+	}
+	if (chunk) {
+		mem_chunk_t *extra = chunk->next;
+		chunk->next = NULL;
+		while (extra) {
+			mem_chunk_t *next = extra->next;
+			free(extra);
+			extra = next;
+		}
+	}
+	conn->arena_cur = conn->arena;
+	conn->arena_pos = 0;
+	conn->mem_used  = sizeof(*conn);
+}
+
+static void c_mem_add(connection_t *conn, unsigned int size)
+{
+	unsigned int new_used = conn->mem_used + size;
+	assert(new_used >= conn->mem_used);
+	conn->mem_used = new_used;
+	if (new_used > conn->mem_high) conn->mem_high = new_used;
+}
+
+static void c_mem_sub(connection_t *conn, unsigned int size)
+{
+	unsigned int new_used = conn->mem_used - size;
+	assert(new_used <= conn->mem_used);
+	conn->mem_used = new_used;
+}
+
+static int c_alloc_large(connection_t *conn, void **res, unsigned int size)
 {
-	unsigned int new_used;
 	unsigned int new_size;
-	void *mem;
+	mem_node_t   *node;
 
-	new_size = size + sizeof(mem_node_t);
+	new_size = size + sizeof(*node);
 	assert(new_size > size);
-	new_used = conn->mem_used + new_size;
-	assert(new_used > conn->mem_used && new_used > new_size);
-	mem = malloc(new_size);
-	if (mem) {
-		mem_node_t *node = mem;
-		mem_addtail(&conn->mem_list, node);
-		node->size = size;
-		conn->mem_used = new_used;
-		*res = node + 1;
-		return 0;
-	} else {
+	node = malloc(new_size);
+	if (!node) {
 		*res = NULL;
 		return 1;
 	}
+	mem_addtail(&conn->mem_list, node);
+	node->size = size;
+	c_mem_add(conn, new_size);
+	*res = node + 1;
+	return 0;
+}
+
+static int c_arena_next(connection_t *conn)
+{
+	mem_chunk_t *chunk;
+
+	if (conn->arena_cur && conn->arena_cur->next) {
+		chunk = conn->arena_cur->next;
+	} else {
+		chunk = malloc(sizeof(*chunk) + ARENA_CHUNK_SIZE);
+		if (!chunk) return 1;
+		chunk->next = NULL;
+		if (conn->arena_cur) {
+			conn->arena_cur->next = chunk;
+		} else {
+			conn->arena = chunk;
+		}
+	}
+	conn->arena_cur = chunk;
+	conn->arena_pos = 0;
+	return 0;
+}
+
+/* Is this the most recent allocation in the arena? */
+static int c_arena_is_last(connection_t *conn, void *mem, unsigned int asize)
+{
+	if (!conn->arena_cur || conn->arena_pos < asize) return 0;
+	return (char *)mem + asize == ARENA_DATA(conn->arena_cur) + conn->arena_pos;
+}
+
+int c_alloc(connection_t *conn, void **res, unsigned int size)
+{
+	unsigned int asize = ARENA_SIZE(size);
+
+	assert(asize >= size);
+	if (asize > ARENA_LARGE) return c_alloc_large(conn, res, size);
+	if (!conn->arena_cur || conn->arena_pos + asize > ARENA_CHUNK_SIZE) {
+		if (c_arena_next(conn)) {
+			*res = NULL;
+			return 1;
+		}
+	}
+	*res = ARENA_DATA(conn->arena_cur) + conn->arena_pos;
+	conn->arena_pos += asize;
+	c_mem_add(conn, asize);
+	return 0;
 }
 
 /* Can only expand allocation. Leaves old allocation in case of failure. */
 void *c_realloc(connection_t *conn, void *ptr, unsigned int old_size,
                 unsigned int new_size, int *res)
 {
+	unsigned int old_asize = ARENA_SIZE(old_size);
+	unsigned int new_asize = ARENA_SIZE(new_size);
 	void *new;
 
 	assert(old_size < new_size);
-	*res = c_alloc(conn, &new, new_size);
-	if (*res) return ptr;
-	if (old_size) {
-		assert(ptr);
-		memcpy(new, ptr, old_size);
-		c_free(conn, ptr, old_size);
-	} else {
+	if (!old_size) {
 		assert(!ptr);
+		*res = c_alloc(conn, &new, new_size);
+		return *res ? ptr : new;
+	}
+	assert(ptr);
+	if (old_asize > ARENA_LARGE) {
+		mem_node_t *node = ((mem_node_t *)ptr) - 1;
+		assert(node->size == old_size);
+		mem_remove(&conn->mem_list, node);
+		mem_node_t *new_node = realloc(node, new_size + sizeof(*node));
+		if (!new_node) {
+			mem_addtail(&conn->mem_list, node);
+			*res = 1;
+			return ptr;
+		}
+		mem_addtail(&conn->mem_list, new_node);
+		new_node->size = new_size;
+		c_mem_add(conn, new_size - old_size);
+		*res = 0;
+		return new_node + 1;
 	}
+	if (new_asize <= ARENA_LARGE
+	    && c_arena_is_last(conn, ptr, old_asize)
+	    && conn->arena_pos - old_asize + new_asize <= ARENA_CHUNK_SIZE
+	   ) { // Grow in place
+		conn->arena_pos += new_asize - old_asize;
+		c_mem_add(conn, new_asize - old_asize);
+		*res = 0;
+		return ptr;
+	}
+	*res = c_alloc(conn, &new, new_size);
+	if (*res) return ptr;
+	memcpy(new, ptr, old_size);
+	c_free(conn, ptr, old_size);
 	return new;
 }
 
+/* Small allocations are only reclaimed if they were the last one made, *
+ * otherwise they stay until c_reset.                                    */
 void c_free(connection_t *conn, void *mem, unsigned int size)
 {
-	unsigned int new_used;
-	unsigned int new_size;
+	unsigned int asize = ARENA_SIZE(size);
 	mem_node_t   *node;
 
-	new_size = size + sizeof(*node);
-	assert(new_size > size);
-	node = ((mem_node_t *)mem) - 1;
-	mem_remove(&conn->mem_list, node);
-	assert(node->size == size);
-	new_used = conn->mem_used - new_size;
-	assert(new_used < conn->mem_used);
-	conn->mem_used = new_used;
-	free(node);
+	if (asize > ARENA_LARGE) {
+		node = ((mem_node_t *)mem) - 1;
+		mem_remove(&conn->mem_list, node);
+		assert(node->size == size);
+		c_mem_sub(conn, size + sizeof(*node));
+		free(node);
+	} else if (c_arena_is_last(conn, mem, asize)) {
+		conn->arena_pos -= asize;
+		c_mem_sub(conn, asize);
+	}
 }
 
 void c_flush(connection_t *conn)
@@ -143,6 +279,59 @@ void c_printf(connection_t *conn, const char *fmt, ...)
 	if (conn->outlen + OUTBUF_MINFREE > sizeof(conn->outbuf)) c_flush(conn);
 }
 
+/* Append raw bytes to the output, without going through printf. */
+void c_write(connection_t *conn, const char *data, unsigned int len)
+{
+	while (len) {
+		unsigned int room = sizeof(conn->outbuf) - conn->outlen;
+		unsigned int z = len < room ? len : room;
+		memcpy(conn->outbuf + conn->outlen, data, z);
+		conn->outlen += z;
+		data += z;
+		len  -= z;
+		if (conn->outlen + OUTBUF_MINFREE > sizeof(conn->outbuf)) {
+			c_flush(conn);
+		}
+	}
+}
+
+void c_puts(connection_t *conn, const char *str)
+{
+	c_write(conn, str, strlen(str));
+}
+
+void c_putc(connection_t *conn, char c)
+{
+	conn->outbuf[conn->outlen++] = c;
+	if (conn->outlen + OUTBUF_MINFREE > sizeof(conn->outbuf)) c_flush(conn);
+}
+
+void c_puthex(connection_t *conn, unsigned long long val)
+{
+	static const char digits[] = "0123456789abcdef";
+	char buf[16];
+	char *ptr = buf + sizeof(buf);
+	do {
+		*--ptr = digits[val & 15];
+		val >>= 4;
+	} while (val);
+	c_write(conn, ptr, buf + sizeof(buf) - ptr);
+}
+
+void c_putdec(connection_t *conn, long long val)
+{
+	char buf[24];
+	char *ptr = buf + sizeof(buf);
+	unsigned long long uval = val;
+	if (val < 0) uval = -uval;
+	do {
+		*--ptr = '0' + uval % 10;
+		uval /= 10;
+	} while (uval);
+	if (val < 0) *--ptr = '-';
+	c_write(conn, ptr, buf + sizeof(buf) - ptr);
+}
+
 void c_read_data(connection_t *conn)
 {
 	if (conn->getlen != conn->getpos) return;
@@ -118,69 +118,87 @@ static int64_t dt_step_end(int valid_steps, struct tm tm)
 	return res;
 }
 
-static int tvc_datetime_step(const tag_value_t *a, tagvalue_cmp_t cmp,
-                             const tag_value_t *b, int inner)
+/* The interval TVC_NUM gives an int with this value and fuzz. */
+static void dt_interval(int64_t v, int64_t fuzz, datetime_interval_t *res)
 {
-	if (!a->val.v_datetime.valid_steps) {
-		tag_value_t fa;
-		fa.val.v_int = datetime_get_simple(&a->val.v_datetime);
-		fa.fuzz.f_int = a->fuzz.f_datetime.d_fuzz;
-		if (inner) {
-			return tvc_int(b, cmp, &fa, NULL);
-		} else {
-			return tvc_datetime_step(b, cmp, &fa, 1);
-		}
+	if (fuzz < 0) {
+		res->low  = v + fuzz;
+		res->high = v - fuzz;
 	} else {
-		struct tm tm;
-		int *field[] = {&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-		                &tm.tm_hour, &tm.tm_min, &tm.tm_sec};
-		memset(&tm, 0, sizeof(tm));
-		tm.tm_year = a->val.v_datetime.year;
-		tm.tm_mon  = a->val.v_datetime.month;
-		for (int i = 2; i < arraylen(field); i++) {
-			*field[i] = a->val.v_datetime.data.field[i - 2];
-		}
-		struct tm tm2;
-		memcpy(&tm2, &tm, sizeof(tm));
-		tag_value_t fa;
-		int pos = a->val.v_datetime.valid_steps;
-		int tz_offset = a->val.v_datetime.tz_mins * 60;
-		int64_t psf = a->fuzz.f_datetime.d_fuzz;
-		int64_t nsf = 0;
-		if (psf < 0) {
-			nsf = psf;
-			psf *= -2;
-		}
-		for (int f = 0; f < 4; f++) {
-			int fuzz = a->fuzz.f_datetime.d_step[f];
-			int start = fuzz < 0 ? fuzz : 0;
-			int stop = abs(fuzz);
-			for (int i = start; i <= stop; i++) {
-				memcpy(&tm, &tm2, sizeof(tm));
-				*field[f] += i;
-				int64_t unixtime;
-				fixed_mktime(&tm, &unixtime);
-				int implfuzz = 0;
-				if (pos < 6) {
-					int64_t t2 = dt_step_end(pos, tm);
-					implfuzz = t2 - unixtime;
-				}
-				fa.val.v_int = unixtime + nsf + tz_offset;
-				fa.fuzz.f_int = psf + implfuzz;
-				int r;
-				if (inner) {
-					r = tvc_int(b, cmp, &fa, NULL);
-				} else {
-					r = tvc_datetime_step(b, cmp, &fa, 1);
-				}
-				if (r) return 1;
+		res->low  = v;
+		res->high = v + fuzz;
+	}
+}
+
+/* The epoch intervals a value stands for. Without steps that is just *
+ * one, otherwise one for every step (including the implicit fuzz of *
+ * the unspecified fields, which differs between steps). Returns how  *
+ * many were put in res, which has room for DT_MAX_INTERVALS.         */
+static int dt_intervals(const tag_value_t *a, datetime_interval_t *res)
+{
+	if (!a->val.v_datetime.valid_steps) {
+		dt_interval(datetime_get_simple(&a->val.v_datetime),
+		            a->fuzz.f_datetime.d_fuzz, res);
+		return 1;
+	}
+	struct tm tm;
+	int *field[] = {&tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+	                &tm.tm_hour, &tm.tm_min, &tm.tm_sec};
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = a->val.v_datetime.year;
+	tm.tm_mon  = a->val.v_datetime.month;
+	for (int i = 2; i < arraylen(field); i++) {
+		*field[i] = a->val.v_datetime.data.field[i - 2];
+	}
+	struct tm tm2;
+	memcpy(&tm2, &tm, sizeof(tm));
+	int pos = a->val.v_datetime.valid_steps;
+	int tz_offset = a->val.v_datetime.tz_mins * 60;
+	int64_t psf = a->fuzz.f_datetime.d_fuzz;
+	int64_t nsf = 0;
+	int count = 0;
+	if (psf < 0) {
+		nsf = psf;
+		psf *= -2;
+	}
+	for (int f = 0; f < 4; f++) {
+		int fuzz = a->fuzz.f_datetime.d_step[f];
+		int start = fuzz < 0 ? fuzz : 0;
+		int stop = abs(fuzz);
+		for (int i = start; i <= stop; i++) {
+			// Step 0 is the same for every field
+			if (!i && f) continue;
+			memcpy(&tm, &tm2, sizeof(tm));
+			*field[f] += i;
+			int64_t unixtime;
+			fixed_mktime(&tm, &unixtime);
+			int implfuzz = 0;
+			if (pos < 6) {
+				int64_t t2 = dt_step_end(pos, tm);
+				implfuzz = t2 - unixtime;
 			}
+			dt_interval(unixtime + nsf + tz_offset, psf + implfuzz,
+			            &res[count++]);
 		}
-		return 0;
+	}
+	return count;
+}
+
+void datetime_span(const tag_value_t *tv, datetime_span_t *res)
+{
+	datetime_interval_t iv[DT_MAX_INTERVALS];
+	int count = dt_intervals(tv, iv);
+	res->low = res->max_low = iv[0].low;
+	res->high = res->min_high = iv[0].high;
+	for (int i = 1; i < count; i++) {
+		if (iv[i].low < res->low) res->low = iv[i].low;
+		if (iv[i].low > res->max_low) res->max_low = iv[i].low;
+		if (iv[i].high > res->high) res->high = iv[i].high;
+		if (iv[i].high < res->min_high) res->min_high = iv[i].high;
 	}
 }
 
-static int64_t dt_make_simple(const datetime_time_t *val)
+int64_t dt_make_simple(const datetime_time_t *val)
 {
 	if (!val->valid_steps) return datetime_get_simple(val);
 	struct tm tm;
@@ -207,7 +225,40 @@ int tvc_datetime(const tag_value_t *a, tagvalue_cmp_t cmp,
 		if (av > bv) return 1;
 		return 0;
 	}
-	return tvc_datetime_step(a, cmp, b, 0);
+	if (cmp != CMP_EQ) {
+		// Some pair of intervals compares, so the extremes do.
+		datetime_span_t as, bs;
+		datetime_span(a, &as);
+		datetime_span(b, &bs);
+		switch (cmp) {
+			case CMP_GT:
+				return as.high > bs.low;
+				break;
+			case CMP_GE:
+				return as.high >= bs.low;
+				break;
+			case CMP_LT:
+				return as.min_high < bs.max_low;
+				break;
+			case CMP_LE:
+				return as.min_high <= bs.max_low;
+				break;
+			default:
+				return 0;
+				break;
+		}
+	}
+	datetime_interval_t ai[DT_MAX_INTERVALS], bi[DT_MAX_INTERVALS];
+	int a_count = dt_intervals(a, ai);
+	int b_count = dt_intervals(b, bi);
+	for (int i = 0; i < a_count; i++) {
+		for (int j = 0; j < b_count; j++) {
+			if (ai[i].low <= bi[j].high && bi[j].low <= ai[i].high) {
+				return 1;
+			}
+		}
+	}
+	return 0;
 }
 
 static int tvp_datetimefuzz(const char *val, double *r, char *r_unit)
@@ -22,6 +22,9 @@ ss128_head_t *posts;
 hash_t       *strings;
 post_list_t  *postlist_nodes;
 
+/* Bumped whenever any post is added, removed or retagged. */
+uint32_t post_generation = 0;
+
 int default_timezone = 0;
 int log_version = -1;
 
@@ -401,7 +404,7 @@ again:
 }
 
 // Mostly the same thing as post_tag()
-static int post_tag_set_value(post_t *post, const tag_t *tag, truth_t weak,
+static int post_tag_set_value(post_t *post, tag_t *tag, truth_t weak,
                               tag_value_t *value)
 {
 	assert(post);
@@ -414,7 +417,11 @@ static int post_tag_set_value(post_t *post, const tag_t *tag, truth_t weak,
 				if (tl->values[i] == value) {
 					return 0;
 				} else {
+					value_index_change(tag, post, tl->values[i],
+					                   value);
 					tl->values[i] = value;
+					tag->generation++;
+					post_generation++;
 					return 1;
 				}
 			}
@@ -610,12 +617,19 @@ static int post_tag_rem_i(post_t *post, tag_t *tag, int implied)
 	if (!implied && (taglist_contains(post->implied_tags, tag)
 	                 || taglist_contains(post->implied_weak_tags, tag))
 	   ) return 1;
+	const tag_value_t *old_value = post_tag_value(post, tag);
 	if (!taglist_remove(&post->tags, tag)) {
+		value_index_change(tag, post, old_value, NULL);
 		post->of_tags--;
+		tag->generation++;
+		post_generation++;
 		return postlist_remove(&tag->posts, post);
 	}
 	if (!taglist_remove(post->weak_tags, tag)) {
+		value_index_change(tag, post, old_value, NULL);
 		post->of_weak_tags--;
+		tag->generation++;
+		post_generation++;
 		return postlist_remove(&tag->weak_posts, post);
 	}
 	return 1;
@@ -667,6 +681,8 @@ static int post_tag_add_i(post_t *post, tag_t *tag, truth_t weak, int implied,
 	if (post_has_tag(post, tag, T_DONTCARE)) {
 		if (post_tag_rem_i(post, tag, 0)) return 1;
 	}
+	tag->generation++;
+	post_generation++;
 	if (weak) {
 		postlist_add(&tag->weak_posts, post);
 		tl = post->weak_tags;
@@ -682,6 +698,7 @@ static int post_tag_add_i(post_t *post, tag_t *tag, truth_t weak, int implied,
 			if (!tl->tags[i]) {
 				tl->tags[i] = tag;
 				tl->values[i] = mm_dup(tval, sizeof(*tval));
+				value_index_change(tag, post, NULL, tl->values[i]);
 				return 0;
 			}
 		}
@@ -692,6 +709,7 @@ static int post_tag_add_i(post_t *post, tag_t *tag, truth_t weak, int implied,
 	tl->tags[0]  = tag;
 	tl->values[0] = mm_dup(tval, sizeof(*tval));
 	ptl->next    = tl;
+	value_index_change(tag, post, NULL, tl->values[0]);
 	return 0;
 }
 
@@ -813,6 +831,11 @@ tag_t *tag_find_guidstr_value(const char *guidstr, tagvalue_cmp_t *r_cmp,
 				    && tag->valuetype != VT_WORD) return NULL;
 				*r_cmp = CMP_REGEXP;
 				v++;
+			} else if (v[1] == '%') {
+				if (tag->valuetype != VT_STRING
+				    && tag->valuetype != VT_WORD) return NULL;
+				*r_cmp = CMP_WORDS;
+				v++;
 			}
 			break;
 		case '>':
@@ -925,23 +948,39 @@ int post_set_md5(post_t *post, const char *md5str)
 	post->md5 = md5;
 	r = ss128_insert(posts, post, post->md5.key);
 	assert(!r);
+	post_generation++;
 	return 0;
 }
 
+/* For values changed in place, old is a copy from before the change. */
+void post_tag_value_changed(post_t *post, tag_t *tag, const tag_value_t *old)
+{
+	tag_value_t *value = post_tag_value(post, tag);
+	if (!memcmp(old, value, sizeof(*old))) return;
+	value_index_change(tag, post, old, value);
+	tag->generation++;
+	post_generation++;
+}
+
 void post_modify(post_t *post, time_t now)
 {
-	tag_value_t tval;
+	tag_value_t tval, old;
 	tag_value_t *tval_p = post_tag_value(post, magic_tag_modified);
 	if (!tval_p) {
 		memset(&tval, 0, sizeof(tval));
 		tval_p = &tval;
 	}
+	old = *tval_p;
 	if (datetime_get_simple(&tval_p->val.v_datetime) != now) {
 		datetime_set_simple(&tval_p->val.v_datetime, now);
 		datetime_strfix(tval_p);
 	}
 	if (!tval_p->v_str) datetime_strfix(tval_p);
-	if (tval_p == &tval) post_tag_add(post, magic_tag_modified, T_NO, &tval);
+	if (tval_p == &tval) {
+		post_tag_add(post, magic_tag_modified, T_NO, &tval);
+	} else {
+		post_tag_value_changed(post, magic_tag_modified, &old);
+	}
 }
 
 typedef struct logfh {
@@ -1035,6 +1074,7 @@ static int populate_from_log_line(char *line)
 			printf("Log: What? %s\n", line);
 			r = 1;
 	}
+	c_reset(logconn);
 	return r;
 }
 
@@ -1353,12 +1393,19 @@ void db_serve(void)
 			if (fds[i].revents & POLLIN) {
 				c_read_data(conn);
 			}
-			if (c_get_line(conn) > 0) {
-				char *buf = utf_compose(conn, conn->linebuf, 0);
-				if (buf) {
-					client_handle(conn, buf);
-					free(buf);
+			int len = c_get_line(conn);
+			if (len > 0) {
+				if (utf_is_ascii(conn->linebuf, len)) {
+					client_handle(conn, conn->linebuf);
+				} else {
+					char *buf = utf_compose(conn,
+					                        conn->linebuf, 0);
+					if (buf) {
+						client_handle(conn, buf);
+						free(buf);
+					}
 				}
+				c_reset(conn);
 			}
 			if (!(conn->flags & CONNFLAG_GOING)) {
 				close(fds[i].fd);
@@ -114,6 +114,23 @@ typedef struct datetime_fuzz {
 	int32_t d_fuzz;
 } datetime_fuzz_t;
 
+// An inclusive range of seconds since the epoch
+typedef struct datetime_interval {
+	int64_t low;
+	int64_t high;
+} datetime_interval_t;
+
+// The extremes of the intervals of a (possibly stepped) datetime
+typedef struct datetime_span {
+	int64_t low;      // Lowest low end
+	int64_t max_low;  // Highest low end
+	int64_t min_high; // Lowest high end
+	int64_t high;     // Highest high end
+} datetime_span_t;
+
+// Four fields with up to 127 steps either way
+#define DT_MAX_INTERVALS (4 * 255)
+
 // In radians
 typedef struct gps_pos {
 	float lat;
@@ -165,6 +182,7 @@ typedef enum {
 	CMP_LT,
 	CMP_LE,
 	CMP_REGEXP,
+	CMP_WORDS,
 	CMP_CMP,
 } tagvalue_cmp_t;
 
@@ -194,6 +212,11 @@ typedef _ALIGN(struct mem_list {
 	mem_node_t *tail;
 }) mem_list_t;
 
+// Per connection bump allocator, rewound after every command.
+typedef _ALIGN(struct mem_chunk {
+	struct mem_chunk *next;
+}) mem_chunk_t;
+
 typedef struct post post_t;
 
 typedef _ALIGN(struct post_node {
@@ -212,6 +235,7 @@ _ALIGN(struct post {
 	md5_t          md5;
 	uint32_t       of_tags;
 	uint32_t       of_weak_tags;
+	uint32_t       ordinal; // dense, for the columns in column.c
 	post_list_t    related_posts;
 	post_taglist_t tags;
 	post_taglist_t *weak_tags;
@@ -258,6 +282,7 @@ struct _ALIGN(tag {
 	post_list_t  weak_posts;
 	impllist_t   *implications;
 	valuetype_t  valuetype;
+	uint32_t     generation; // bumped when the set of posts changes
 	unsigned int ordered    : 1;
 	unsigned int unsettable : 1;
 	unsigned int datatag    : 1;
@@ -335,8 +360,15 @@ struct connection {
 	trans_t         trans;
 	int             sock;
 	connflag_t      flags;
-	mem_list_t      mem_list;
+	mem_list_t      mem_list; // Large allocations
+	mem_chunk_t     *arena;
+	mem_chunk_t     *arena_cur;
+	unsigned int    arena_pos;
 	unsigned int    mem_used;
+	unsigned int    mem_high;
+	ss128_head_t    tagdict; // Ftagdict ids, lives as long as the connection
+	unsigned int    tagdict_next;
+	unsigned int    cursor_next;
 	unsigned int    getlen;
 	unsigned int    getpos;
 	unsigned int    outlen;
@@ -352,6 +384,24 @@ typedef struct result {
 	uint32_t room;
 } result_t;
 
+// A search result kept between commands (SP .. C), see client.c.
+typedef struct cursor_node {
+	struct cursor_node *succ;
+	struct cursor_node *pred;
+	connection_t *conn;
+	post_t       **posts;
+	uint32_t     *by_md5; // Positions sorted by md5, made on first RM.
+	uint32_t     of_posts;
+	unsigned int id;
+	int          flags;
+	time_t       used;
+} cursor_node_t;
+
+typedef struct cursor_list {
+	cursor_node_t *head;
+	cursor_node_t *tail;
+} cursor_list_t;
+
 typedef struct search_tag {
 	tag_t          *tag;
 	truth_t        weak;
@@ -359,19 +409,50 @@ typedef struct search_tag {
 	tag_value_t    val;
 } search_tag_t;
 
+// A tag that adds weight to the score of posts in ranked searches.
+typedef struct rank_tag {
+	search_tag_t t;
+	uint32_t     weight;
+} rank_tag_t;
+
 void result_free(connection_t *conn, result_t *result);
 int result_add_post(connection_t *conn, result_t *result, post_t *post);
 int result_remove_tag(connection_t *conn, result_t *result, search_tag_t *t);
-int result_intersect(connection_t *conn, result_t *result, search_tag_t *t);
+int result_remove_list(connection_t *conn, result_t *result, search_tag_t *t);
+int result_intersect(connection_t *conn, result_t *result, search_tag_t *t,
+                     int list_order);
+void result_sort_set(result_t *result);
+int result_filter_set(connection_t *conn, result_t *result,
+                      const result_t *set);
+int result_merge_sets(connection_t *conn, result_t *res, const result_t *a,
+                      const result_t *b, int intersect);
+int result_rank(connection_t *conn, result_t *result, rank_tag_t *ranked,
+                unsigned int of_ranked, const search_tag_t *excluded,
+                unsigned int of_excluded, uint32_t k);
+typedef int (*result_walk_f)(post_t *post, void *data);
+int result_walk(const search_tag_t *included, unsigned int of_tags,
+                const search_tag_t *excluded, unsigned int of_excluded,
+                int list_order, result_walk_f callback, void *cb_data);
+int result_quick_count(const search_tag_t *included, unsigned int of_tags,
+                       unsigned int of_excluded, uint32_t *r_count);
+int result_count(const search_tag_t *included, unsigned int of_tags,
+                 const search_tag_t *excluded, unsigned int of_excluded,
+                 uint32_t *r_count);
 
 int c_init(connection_t **res_conn, int sock, prot_err_func_t error);
 int c_alloc(connection_t *conn, void **res, unsigned int size);
 void *c_realloc(connection_t *conn, void *ptr, unsigned int old_size,
                 unsigned int new_size, int *res);
 void c_free(connection_t *conn, void *mem, unsigned int size);
+void c_reset(connection_t *conn);
 void c_cleanup(connection_t *conn);
 void c_printf(connection_t *conn, const char *fmt, ...);
 void c_flush(connection_t *conn);
+void c_write(connection_t *conn, const char *data, unsigned int len);
+void c_puts(connection_t *conn, const char *str);
+void c_putc(connection_t *conn, char c);
+void c_puthex(connection_t *conn, unsigned long long val);
+void c_putdec(connection_t *conn, long long val);
 void c_read_data(connection_t *conn);
 int c_get_line(connection_t *conn);
 int c_error(connection_t *conn, const char *what);
@@ -405,6 +486,7 @@ int post_tag_rem(post_t *post, tag_t *tag);
 int post_tag_add(post_t *post, tag_t *tag, truth_t weak, tag_value_t *tval);
 int post_has_tag(const post_t *post, const tag_t *tag, truth_t weak);
 tag_value_t *post_tag_value(const post_t *post, const tag_t *tag);
+void post_tag_value_changed(post_t *post, tag_t *tag, const tag_value_t *old);
 int post_find_md5str(post_t **res_post, const char *md5str);
 int post_set_md5(post_t *post, const char *md5str);
 void post_modify(post_t *post, time_t now);
@@ -422,10 +504,15 @@ int str2id(const char *str, const char * const *ids);
 typedef void (*ss128_callback_t)(ss128_key_t key, ss128_value_t value,
               void *data);
 void ss128_iterate(ss128_head_t *head, ss128_callback_t callback, void *data);
+void ss128_iterate_range(ss128_head_t *head, ss128_key_t low,
+                         ss128_key_t high, ss128_callback_t callback,
+                         void *data);
 int ss128_insert(ss128_head_t *head, ss128_value_t value, ss128_key_t key);
 int ss128_delete(ss128_head_t *head, ss128_key_t key);
 int ss128_find(ss128_head_t *head, ss128_value_t *r_value, ss128_key_t key);
 int ss128_init(ss128_head_t *head, ss128_allocmem_t, ss128_freemem_t, void *memarg);
+int ss128_heap_alloc(void *data, void *res, unsigned int z);
+void ss128_heap_free(void *data, void *ptr, unsigned int z);
 void ss128_free(ss128_head_t *head);
 int ss128_count(ss128_head_t *head);
 ss128_key_t ss128_str2key(const char *str);
@@ -447,6 +534,30 @@ void mm_print(void);
 void mm_start_walker(void);
 
 void client_handle(connection_t *conn, char *buf);
+void client_cleanup(connection_t *conn);
+void tag_render_forget(const tag_t *tag);
+void tag_stats_forget(const tag_t *tag);
+void search_cache_forget(const tag_t *tag);
+
+uint64_t double_key(double v);
+void value_index_forget(const tag_t *tag);
+void value_index_change(const tag_t *tag, post_t *post,
+                        const tag_value_t *old, const tag_value_t *new);
+int value_index_usable(const tag_t *tag, tagvalue_cmp_t cmp,
+                       const tag_value_t *val);
+int value_index_exact(const tag_t *tag, tagvalue_cmp_t cmp);
+int value_index_scan(const tag_t *tag, tagvalue_cmp_t cmp,
+                     const tag_value_t *val, ss128_callback_t callback,
+                     void *data);
+typedef void (*value_distinct_cb_t)(tag_value_t *tv, unsigned int count,
+                                    void *data);
+int value_index_distinct(const tag_t *tag, value_distinct_cb_t callback,
+                         void *data);
+
+tag_value_t *post_column_value(const post_t *post, const tag_t *tag);
+void column_change(const tag_t *tag, const post_t *post,
+                   const tag_value_t *value);
+void column_forget(const tag_t *tag);
 
 void log_trans_start(connection_t *conn, time_t now);
 int log_trans_start_outer(connection_t *conn, time_t now);
@@ -477,9 +588,18 @@ int utf_fuzz_c(connection_t *conn, const char *str, char **res,
                unsigned int *res_len);
 const char *utf_fuzz_mm(const char *str);
 char *utf_compose(connection_t *conn, const char *str, int len);
+int utf_is_ascii(const char *str, unsigned int len);
+typedef int (*utf_word_cb_t)(const char *word, void *data);
+int utf_words(const char *str, utf_word_cb_t callback, void *data);
+int utf_has_words(const char *str, const char *words);
 
 typedef int (*sort_compar_t)(const void *a, const void *b, void *data);
+typedef uint64_t (*sort_key_t)(const void *a, void *data);
 void sort(void *base, int nmemb, size_t size, sort_compar_t comp, void *data);
+void sort_radix(void *base, int nmemb, size_t size, sort_key_t key,
+                sort_compar_t comp, void *data);
+void sort_partial(void *base, int nmemb, int start, int end, size_t size,
+                  sort_compar_t comp, void *data);
 
 typedef void (*post_callback_t)(post_node_t *node, void *data);
 void post_newlist(post_list_t *list);
@@ -493,11 +613,18 @@ void mem_newlist(mem_list_t *list);
 void mem_addtail(mem_list_t *list, mem_node_t *node);
 void mem_remove(mem_list_t *list, mem_node_t *node);
 
+void cursor_newlist(cursor_list_t *list);
+void cursor_addtail(cursor_list_t *list, cursor_node_t *node);
+void cursor_remove(cursor_list_t *list, cursor_node_t *node);
+
 void apply_fixups(int i);
 void after_fixups(void);
 void internal_fixups0(void);
 void internal_fixups1(void);
 
+regex_t *regex_cached(const char *pattern);
+void regex_cache_trim(void);
+
 #define TVC_PROTO(n) int tvc_##n(const tag_value_t *a, tagvalue_cmp_t cmp, \
                                  const tag_value_t *b, regex_t *re)
 TVC_PROTO(none);
@@ -509,6 +636,7 @@ TVC_PROTO(datetime);
 TVC_PROTO(gps);
 
 int tv_parser_gps(const char *val, gps_pos_t *v, gps_fuzz_t *f);
+void gps_unit_vector(const gps_pos_t pos, double *r);
 
 double fractod(const char *val, char **r_end);
 int tv_parser_datetime(const char *val, datetime_time_t *v, datetime_fuzz_t *f,
@@ -516,6 +644,8 @@ int tv_parser_datetime(const char *val, datetime_time_t *v, datetime_fuzz_t *f,
 int tvp_timezone(const char *val, int *len, int *r_offset);
 int64_t datetime_get_simple(const datetime_time_t *val);
 void datetime_set_simple(datetime_time_t *val, int64_t simple);
+int64_t dt_make_simple(const datetime_time_t *val);
+void datetime_span(const tag_value_t *tv, datetime_span_t *res);
 
 int tag_check_vt_change(tag_t *tag, valuetype_t vt);
 
@@ -529,6 +659,7 @@ extern post_list_t  *postlist_nodes;
 extern uint64_t *logindex;
 extern uint64_t *first_logindex;
 extern uint64_t *logdumpindex;
+extern uint32_t *post_ordinals;
 
 extern const char * const *filetype_names;
 extern const char * const *rating_names;
@@ -538,6 +669,11 @@ extern md5_t config_md5;
 extern const char *basedir;
 
 extern connection_t *logconn;
+extern unsigned int c_mem_high;
+extern uint32_t post_generation;
+extern unsigned long search_cache_hits;
+extern unsigned long search_cache_misses;
+extern unsigned long tv_evaluations;
 
 extern int server_running;
 extern int log_version;
@@ -8,10 +8,22 @@ static const double EXTRA_FUZZ = 0.00000000000002;
 
 static double sphere_dist(const gps_pos_t a, const gps_pos_t b)
 {
-	const double d = acos(sin(a.lat) * sin(b.lat)
-	                      + cos(a.lat) * cos(b.lat) * cos(b.lon - a.lon)
-	                     );
-	return isnormal(d) ? d : M_PI;
+	double c = sin(a.lat) * sin(b.lat)
+	           + cos(a.lat) * cos(b.lat) * cos(b.lon - a.lon);
+	// Rounding can put (nearly) equal positions just outside acos' domain
+	if (c > 1.0) c = 1.0;
+	if (c < -1.0) c = -1.0;
+	return acos(c);
+}
+
+/* The position as a point on the unit sphere. The dot product of two *
+ * of these is the cosine of the distance between the positions.      */
+void gps_unit_vector(const gps_pos_t pos, double *r)
+{
+	const double clat = cos(pos.lat);
+	r[0] = clat * cos(pos.lon);
+	r[1] = clat * sin(pos.lon);
+	r[2] = sin(pos.lat);
 }
 
 static double sphere_fuzz_lon(const double lat, const double fuzz)
@@ -19,7 +31,11 @@ static double sphere_fuzz_lon(const double lat, const double fuzz)
 	const double clat = cos(lat);
 	if (clat == 0) return M_PI; // pole
 	const double slat = sin(lat);
-	return acos((cos(fuzz) - slat * slat) / (clat * clat));
+	double c = (cos(fuzz) - slat * slat) / (clat * clat);
+	// As in sphere_dist, tiny fuzz can round to just above 1
+	if (c > 1.0) c = 1.0;
+	if (c < -1.0) c = -1.0;
+	return acos(c);
 }
 
 TVC_PROTO(gps)
@@ -47,7 +63,7 @@ TVC_PROTO(gps)
 			return ga.lat <= gb.lat && ga.lon <= gb.lon;
 		}
 	}
-	if (cmp != CMP_CMP) return 0;
+	if (cmp != CMP_EQ && cmp != CMP_CMP) return 0;
 	const double dist = sphere_dist(a->val.v_gps, b->val.v_gps);
 	return dist <= a->fuzz.f_gps + b->fuzz.f_gps;
 }
@@ -0,0 +1,1161 @@
+#include "db.h"
+
+#include <ctype.h>
+#include <math.h>
+
+/* Ordered indexes over the values of numeric tags (int, uint, float,  *
+ * f-stop, stop and datetime). With fuzz every value is an interval    *
+ * (see TVC_NUM in result.c, and datetime_span for stepped datetimes), *
+ * and posts are kept ordered by the high end of theirs.               *
+ * A comparison becomes a range of high ends holding every match, and  *
+ * the caller checks those candidates with tv_cmp as usual. Datetime   *
+ * entries keep their span, so those are checked in the scan instead   *
+ * (see value_index_exact).                                            *
+ * GPS positions are ordered by latitude instead, which no match can   *
+ * be further from than the distance, and carry a unit vector so the   *
+ * candidates in that band are filtered by a dot product.              *
+ * Words and strings are only indexed for equality, ordered by a hash  *
+ * of the value so all posts with one value are next to each other.    *
+ * For regexps and word searches there are token indexes, see below.  *
+ * Indexes are kept in memory, not in the mm cache. One is built the   *
+ * first time a search can use it, and from then on kept up to date   *
+ * by value_index_change, until the tag is deleted or changes type.    */
+
+typedef enum {
+	INDEX_NONE,
+	INDEX_INT,
+	INDEX_UINT,
+	INDEX_DOUBLE,
+	INDEX_DATETIME,
+	INDEX_GPS,
+	INDEX_STRING,
+} index_kind_t;
+
+typedef struct value_index {
+	ss128_head_t tree;        // key.a: key of the high end, key.b: post
+	index_kind_t kind;
+	uint64_t     max_width;   // high - low, for all but INDEX_DOUBLE
+	double       max_width_d; // for INDEX_DOUBLE
+	uint64_t     max_spread;  // high - min_high, for INDEX_DATETIME
+	double       max_fuzz;    // for INDEX_GPS
+} value_index_t;
+
+/* INDEX_GPS trees hold these instead of the post. */
+typedef struct gps_entry {
+	post_t *post;
+	double unit[3];
+} gps_entry_t;
+
+/* And INDEX_DATETIME trees these, so scans compare the span of the *
+ * value without expanding its steps again.                        */
+typedef struct datetime_entry {
+	post_t          *post;
+	datetime_span_t span;
+} datetime_entry_t;
+
+// Radians of slack for the float positions in tvc_gps.
+#define GPS_SLACK 1e-6
+
+// The extra fuzz TVC_NUM gives doubles.
+#define DOUBLE_FF 0.07
+
+static ss128_head_t indexes;
+static ss128_head_t gram_indexes; // token_index_t of trigrams
+static ss128_head_t word_indexes; // token_index_t of words
+static int          indexes_inited = 0;
+
+static void indexes_init(void)
+{
+	if (indexes_inited) return;
+	ss128_init(&indexes, ss128_heap_alloc, ss128_heap_free, NULL);
+	ss128_init(&gram_indexes, ss128_heap_alloc, ss128_heap_free, NULL);
+	ss128_init(&word_indexes, ss128_heap_alloc, ss128_heap_free, NULL);
+	indexes_inited = 1;
+}
+
+static index_kind_t index_kind(valuetype_t vt)
+{
+	switch (vt) {
+		case VT_INT:
+			return INDEX_INT;
+		case VT_UINT:
+			return INDEX_UINT;
+		case VT_FLOAT:
+		case VT_F_STOP:
+		case VT_STOP:
+			return INDEX_DOUBLE;
+		case VT_DATETIME:
+			return INDEX_DATETIME;
+		case VT_GPS:
+			return INDEX_GPS;
+		case VT_WORD:
+		case VT_STRING:
+			return INDEX_STRING;
+		default:
+			return INDEX_NONE;
+	}
+}
+
+/* A 64 bit key with the same order as the double. */
+uint64_t double_key(double v)
+{
+	uint64_t key;
+	if (v == 0.0) return 1ULL << 63; // -0.0 sorts with 0.0
+	memcpy(&key, &v, sizeof(key));
+	return (key >> 63) ? ~key : key | (1ULL << 63);
+}
+
+static uint64_t int_key(int64_t v)
+{
+	return (uint64_t)v ^ (1ULL << 63);
+}
+
+/* FNV-1a. Only words are interned by mm_strdup, string values are *
+ * not, so the pointer can not be the key.                         */
+static uint64_t str_key(const char *str)
+{
+	uint64_t key = 14695981039346656037ULL;
+	while (*str) {
+		key ^= (unsigned char)*str++;
+		key *= 1099511628211ULL;
+	}
+	return key;
+}
+
+/* Keys of the ends of the interval of a value, computed like TVC_NUM *
+ * does, and how far apart they are (saturated if it wrapped). A      *
+ * stepped datetime is many intervals, max_low and spread say how far *
+ * the low and high ends of the others are from low and high.         */
+typedef struct index_interval {
+	uint64_t low;
+	uint64_t high;
+	uint64_t max_low;
+	uint64_t spread;
+	uint64_t width;
+	double   width_d;
+} index_interval_t;
+
+static void span_interval(const datetime_span_t *span, index_interval_t *r)
+{
+	r->low     = int_key(span->low);
+	r->high    = int_key(span->high);
+	r->max_low = int_key(span->max_low);
+	r->spread  = int_key(span->high) - int_key(span->min_high);
+	r->width   = r->high >= r->low ? r->high - r->low : UINT64_MAX;
+	r->width_d = 0;
+}
+
+static void index_interval(index_kind_t kind, const tag_value_t *tv,
+                           index_interval_t *r)
+{
+	r->width = 0;
+	r->width_d = 0;
+	r->spread = 0;
+	if (kind == INDEX_STRING) {
+		r->low = r->high = str_key(tv->v_str);
+	} else if (kind == INDEX_DATETIME) {
+		datetime_span_t span;
+		datetime_span(tv, &span);
+		span_interval(&span, r);
+		return;
+	} else if (kind == INDEX_DOUBLE) {
+		double v = tv->val.v_double, f = tv->fuzz.f_double;
+		double low, high;
+		if (f < 0) {
+			low  = v + f - DOUBLE_FF;
+			high = v - f + DOUBLE_FF;
+		} else {
+			low  = v;
+			high = v + f + DOUBLE_FF;
+		}
+		r->low     = double_key(low);
+		r->high    = double_key(high);
+		r->width_d = high - low;
+	} else if (kind == INDEX_INT) {
+		int64_t v = tv->val.v_int, f = tv->fuzz.f_int;
+		int64_t low, high;
+		if (f < 0) {
+			low  = v + f;
+			high = v - f;
+		} else {
+			low  = v;
+			high = v + f;
+		}
+		r->low  = int_key(low);
+		r->high = int_key(high);
+	} else {
+		uint64_t v = tv->val.v_uint;
+		int64_t  f = tv->fuzz.f_uint;
+		uint64_t low, high;
+		if (f < 0) {
+			low  = v + f;
+			high = v - f;
+		} else {
+			low  = v;
+			high = v + f;
+		}
+		r->low  = low;
+		r->high = high;
+	}
+	if (kind != INDEX_DOUBLE) {
+		r->width = r->high >= r->low ? r->high - r->low : UINT64_MAX;
+	}
+	if (kind != INDEX_DATETIME) r->max_low = r->low;
+}
+
+static int gps_index_add(value_index_t *idx, post_t *post,
+                         const tag_value_t *tv)
+{
+	gps_entry_t *entry = malloc(sizeof(*entry));
+	ss128_key_t key;
+
+	if (!entry) return 1;
+	entry->post = post;
+	gps_unit_vector(tv->val.v_gps, entry->unit);
+	key.a = double_key(tv->val.v_gps.lat);
+	key.b = (uintptr_t)post;
+	if (tv->fuzz.f_gps > idx->max_fuzz) idx->max_fuzz = tv->fuzz.f_gps;
+	if (ss128_insert(&idx->tree, entry, key)) {
+		free(entry);
+		return 1;
+	}
+	return 0;
+}
+
+static void gps_index_remove(value_index_t *idx, const post_t *post,
+                             const tag_value_t *tv)
+{
+	ss128_value_t entry;
+	ss128_key_t   key;
+
+	key.a = double_key(tv->val.v_gps.lat);
+	key.b = (uintptr_t)post;
+	if (ss128_find(&idx->tree, &entry, key)) return;
+	ss128_delete(&idx->tree, key);
+	free(entry);
+}
+
+static int value_index_add(value_index_t *idx, post_t *post,
+                           const tag_value_t *tv)
+{
+	datetime_entry_t *entry = NULL;
+	index_interval_t iv;
+	ss128_key_t      key;
+
+	if (!tv || tv->v_str == tag_value_null_marker) return 0;
+	if (idx->kind == INDEX_GPS) return gps_index_add(idx, post, tv);
+	if (idx->kind == INDEX_DATETIME) {
+		entry = malloc(sizeof(*entry));
+		if (!entry) return 1;
+		entry->post = post;
+		datetime_span(tv, &entry->span);
+		span_interval(&entry->span, &iv);
+	} else {
+		index_interval(idx->kind, tv, &iv);
+	}
+	key.a = iv.high;
+	key.b = (uintptr_t)post;
+	if (iv.width > idx->max_width) idx->max_width = iv.width;
+	if (iv.width_d > idx->max_width_d) idx->max_width_d = iv.width_d;
+	if (iv.spread > idx->max_spread) idx->max_spread = iv.spread;
+	if (ss128_insert(&idx->tree, entry ? (void *)entry : post, key)) {
+		free(entry);
+		return 1;
+	}
+	return 0;
+}
+
+static void value_index_remove(value_index_t *idx, const post_t *post,
+                               const tag_value_t *tv)
+{
+	index_interval_t iv;
+	ss128_key_t      key;
+
+	if (!tv || tv->v_str == tag_value_null_marker) return;
+	if (idx->kind == INDEX_GPS) {
+		gps_index_remove(idx, post, tv);
+		return;
+	}
+	index_interval(idx->kind, tv, &iv);
+	key.a = iv.high;
+	key.b = (uintptr_t)post;
+	if (idx->kind == INDEX_DATETIME) {
+		ss128_value_t entry;
+		if (ss128_find(&idx->tree, &entry, key)) return;
+		free(entry);
+	}
+	ss128_delete(&idx->tree, key);
+}
+
+static value_index_t *value_index_find(const tag_t *tag)
+{
+	ss128_value_t v;
+	indexes_init();
+	if (ss128_find(&indexes, &v, tag->guid.key)) return NULL;
+	return v;
+}
+
+static void entry_free_cb(ss128_key_t key, ss128_value_t value, void *data)
+{
+	(void) key;
+	(void) data;
+	free(value);
+}
+
+static void value_index_drop(const tag_t *tag)
+{
+	value_index_t *idx = value_index_find(tag);
+	if (!idx) return;
+	ss128_delete(&indexes, tag->guid.key);
+	if (idx->kind == INDEX_GPS || idx->kind == INDEX_DATETIME) {
+		ss128_iterate(&idx->tree, entry_free_cb, NULL);
+	}
+	ss128_free(&idx->tree);
+	free(idx);
+}
+
+/* Token indexes, for regexps and word searches on words and strings. *
+ * tokens has every token of every value (key.a: token, key.b: post)  *
+ * and counts says how many posts have each token (key.a: token).     *
+ * For regexps the tokens are trigrams: a search takes the literals   *
+ * any match has to contain, walks the posts of the rarest trigram in *
+ * them and checks those posts for the literals before the caller     *
+ * runs regexec. For word searches the tokens are hashes of the words *
+ * from utf_words, and the rarest word is walked.                     */
+
+typedef struct token_index {
+	ss128_head_t tokens;
+	ss128_head_t counts; // values are unsigned int *
+} token_index_t;
+
+typedef int (*token_index_add_t)(token_index_t *ti, post_t *post,
+                                 const tag_value_t *tv);
+typedef void (*token_index_remove_t)(token_index_t *ti, post_t *post,
+                                     const tag_value_t *tv);
+
+#define REGEXP_LITERALS 16
+
+static uint64_t gram_key(const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	return (uint64_t)s[0] << 16 | (uint64_t)s[1] << 8 | s[2];
+}
+
+static int token_count_add(token_index_t *ti, uint64_t token)
+{
+	ss128_key_t   key;
+	ss128_value_t v;
+	unsigned int  *count;
+
+	key.a = token;
+	key.b = 0;
+	if (!ss128_find(&ti->counts, &v, key)) {
+		count = v;
+		(*count)++;
+		return 0;
+	}
+	count = malloc(sizeof(*count));
+	if (!count) return 1;
+	*count = 1;
+	if (ss128_insert(&ti->counts, count, key)) {
+		free(count);
+		return 1;
+	}
+	return 0;
+}
+
+static void token_count_remove(token_index_t *ti, uint64_t token)
+{
+	ss128_key_t   key;
+	ss128_value_t v;
+	unsigned int  *count;
+
+	key.a = token;
+	key.b = 0;
+	if (ss128_find(&ti->counts, &v, key)) return;
+	count = v;
+	if (--(*count)) return;
+	ss128_delete(&ti->counts, key);
+	free(count);
+}
+
+static unsigned int token_count(token_index_t *ti, uint64_t token)
+{
+	ss128_key_t   key;
+	ss128_value_t v;
+
+	key.a = token;
+	key.b = 0;
+	if (ss128_find(&ti->counts, &v, key)) return 0;
+	return *(unsigned int *)v;
+}
+
+static int token_has(token_index_t *ti, const post_t *post, uint64_t token)
+{
+	ss128_key_t key;
+
+	key.a = token;
+	key.b = (uintptr_t)post;
+	return !ss128_find(&ti->tokens, NULL, key);
+}
+
+/* Adds one token for post, if it does not already have it. */
+static int token_add(token_index_t *ti, post_t *post, uint64_t token)
+{
+	ss128_key_t key;
+
+	if (token_has(ti, post, token)) return 0;
+	key.a = token;
+	key.b = (uintptr_t)post;
+	if (ss128_insert(&ti->tokens, post, key)) return 1;
+	return token_count_add(ti, token);
+}
+
+static void token_remove(token_index_t *ti, const post_t *post,
+                         uint64_t token)
+{
+	ss128_key_t key;
+
+	if (!token_has(ti, post, token)) return;
+	key.a = token;
+	key.b = (uintptr_t)post;
+	ss128_delete(&ti->tokens, key);
+	token_count_remove(ti, token);
+}
+
+static int gram_index_add(token_index_t *ti, post_t *post,
+                          const tag_value_t *tv)
+{
+	if (!tv || tv->v_str == tag_value_null_marker) return 0;
+	for (const char *p = tv->v_str; p[0] && p[1] && p[2]; p++) {
+		if (token_add(ti, post, gram_key(p))) return 1;
+	}
+	return 0;
+}
+
+static void gram_index_remove(token_index_t *ti, post_t *post,
+                              const tag_value_t *tv)
+{
+	if (!tv || tv->v_str == tag_value_null_marker) return;
+	for (const char *p = tv->v_str; p[0] && p[1] && p[2]; p++) {
+		token_remove(ti, post, gram_key(p));
+	}
+}
+
+typedef struct word_index_data {
+	token_index_t *ti;
+	post_t        *post;
+} word_index_data_t;
+
+static int word_index_add_cb(const char *word, void *data_)
+{
+	word_index_data_t *data = data_;
+	return token_add(data->ti, data->post, str_key(word));
+}
+
+static int word_index_remove_cb(const char *word, void *data_)
+{
+	word_index_data_t *data = data_;
+	token_remove(data->ti, data->post, str_key(word));
+	return 0;
+}
+
+static int word_index_add(token_index_t *ti, post_t *post,
+                          const tag_value_t *tv)
+{
+	word_index_data_t data;
+
+	if (!tv || tv->v_str == tag_value_null_marker) return 0;
+	data.ti = ti;
+	data.post = post;
+	return !!utf_words(tv->v_str, word_index_add_cb, &data);
+}
+
+static void word_index_remove(token_index_t *ti, post_t *post,
+                              const tag_value_t *tv)
+{
+	word_index_data_t data;
+
+	if (!tv || tv->v_str == tag_value_null_marker) return;
+	data.ti = ti;
+	data.post = post;
+	utf_words(tv->v_str, word_index_remove_cb, &data);
+}
+
+static token_index_t *token_index_find(ss128_head_t *registry,
+                                       const tag_t *tag)
+{
+	ss128_value_t v;
+	indexes_init();
+	if (ss128_find(registry, &v, tag->guid.key)) return NULL;
+	return v;
+}
+
+static void token_count_free_cb(ss128_key_t key, ss128_value_t value,
+                                void *data)
+{
+	(void) key;
+	(void) data;
+	free(value);
+}
+
+static void token_index_drop(ss128_head_t *registry, const tag_t *tag)
+{
+	token_index_t *ti = token_index_find(registry, tag);
+	if (!ti) return;
+	ss128_delete(registry, tag->guid.key);
+	ss128_iterate(&ti->counts, token_count_free_cb, NULL);
+	ss128_free(&ti->counts);
+	ss128_free(&ti->tokens);
+	free(ti);
+}
+
+static token_index_t *token_index_get(ss128_head_t *registry,
+                                      const tag_t *tag, token_index_add_t add)
+{
+	const post_list_t *lists[] = {&tag->posts, &tag->weak_posts};
+	token_index_t *ti = token_index_find(registry, tag);
+
+	if (ti) return ti;
+	ti = calloc(1, sizeof(*ti));
+	if (!ti) return NULL;
+	ss128_init(&ti->tokens, ss128_heap_alloc, ss128_heap_free, NULL);
+	ss128_init(&ti->counts, ss128_heap_alloc, ss128_heap_free, NULL);
+	if (ss128_insert(registry, ti, tag->guid.key)) {
+		free(ti);
+		return NULL;
+	}
+	for (int l = 0; l < 2; l++) {
+		for (post_node_t *pn = lists[l]->head; pn; pn = pn->succ) {
+			if (add(ti, pn->post, post_tag_value(pn->post, tag))) {
+				token_index_drop(registry, tag);
+				return NULL;
+			}
+		}
+	}
+	return ti;
+}
+
+/* Skips a bracket expression, re points at the '['. */
+static const char *regexp_skip_bracket(const char *re)
+{
+	re++;
+	if (*re == '^') re++;
+	if (*re == ']') re++;
+	while (*re != ']') {
+		if (!*re) return NULL;
+		if (*re == '[' && (re[1] == ':' || re[1] == '.' || re[1] == '=')) {
+			const char end = re[1];
+			re += 2;
+			while (*re && !(re[0] == end && re[1] == ']')) re++;
+			if (!*re) return NULL;
+			re++;
+		}
+		re++;
+	}
+	return re + 1;
+}
+
+typedef struct regexp_literals {
+	unsigned int of_lits;
+	const char   *lits[REGEXP_LITERALS];
+	char         *run;  // Start of the literal being collected
+	char         *end;  // End of it
+	char         *last; // Start of its last character, if that is plain
+} regexp_literals_t;
+
+static void regexp_end_run(regexp_literals_t *rl)
+{
+	if (rl->end > rl->run && rl->of_lits < REGEXP_LITERALS) {
+		*rl->end++ = '\0';
+		rl->lits[rl->of_lits++] = rl->run;
+		rl->run = rl->end;
+	}
+	rl->end = rl->run;
+	rl->last = NULL;
+}
+
+/* Finds strings every match of the (extended) regexp re contains.    *
+ * Being conservative is always safe, so anything but plain characters *
+ * just ends the current literal. buf needs room for 6 * strlen(re) + 1 *
+ * bytes. Returns 1 if re has alternatives outside any group, when no  *
+ * literal is required.                                                 */
+static int regexp_literals(const char *re, char *buf, regexp_literals_t *rl)
+{
+	rl->of_lits = 0;
+	rl->run = rl->end = buf;
+	rl->last = NULL;
+	while (*re) {
+		const char c = *re++;
+		int        depth = 1;
+		switch (c) {
+			case '|':
+				return 1;
+				break;
+			case '(': // Skipped, it might have alternatives
+				while (depth) {
+					if (!*re) return 1;
+					if (*re == '[') {
+						re = regexp_skip_bracket(re);
+						if (!re) return 1;
+						continue;
+					}
+					if (*re == '\\' && re[1]) re++;
+					if (*re == '(') depth++;
+					if (*re == ')') depth--;
+					re++;
+				}
+				regexp_end_run(rl);
+				break;
+			case '[':
+				re = regexp_skip_bracket(re - 1);
+				if (!re) return 1;
+				regexp_end_run(rl);
+				break;
+			case '*':
+			case '?':
+			case '{': // The last character is optional
+				if (rl->last) rl->end = rl->last;
+				if (c == '{') {
+					while (*re && *re != '}') re++;
+					if (*re) re++;
+				}
+				regexp_end_run(rl);
+				break;
+			case '+': // Repeats, so it also starts the next literal
+				if (*re == '?' || *re == '*' || *re == '{') {
+					// Quantified again, so optional after all
+					if (rl->last) rl->end = rl->last;
+					regexp_end_run(rl);
+					break;
+				}
+				// Regexps are compiled in the C locale, so after a
+				// multibyte character only its last byte repeats.
+				if (rl->last && rl->end - rl->last == 1) {
+					const char repeated = *rl->last;
+					regexp_end_run(rl);
+					rl->last = rl->end;
+					*rl->end++ = repeated;
+				} else {
+					regexp_end_run(rl);
+				}
+				break;
+			case '.':
+			case '^':
+			case '$':
+			case ')':
+				regexp_end_run(rl);
+				break;
+			case '\\':
+				if (!*re) return 1;
+				if (isalnum((unsigned char)*re) || strchr("<>`'", *re)) {
+					// \w, \b and friends
+					re++;
+					regexp_end_run(rl);
+					break;
+				}
+				rl->last = rl->end;
+				*rl->end++ = *re++;
+				break;
+			default:
+				// Continuation bytes belong to the last character
+				if ((c & 0xc0) != 0x80 || !rl->last) rl->last = rl->end;
+				*rl->end++ = c;
+				break;
+		}
+	}
+	regexp_end_run(rl);
+	return 0;
+}
+
+/* Whether re has a literal long enough to have a trigram. */
+static int regexp_has_gram(const char *re)
+{
+	regexp_literals_t rl;
+	char              *buf = malloc(6 * strlen(re) + 1);
+	int               res = 0;
+
+	if (!buf) return 0;
+	if (!regexp_literals(re, buf, &rl)) {
+		for (unsigned int i = 0; i < rl.of_lits; i++) {
+			if (strlen(rl.lits[i]) >= 3) res = 1;
+		}
+	}
+	free(buf);
+	return res;
+}
+
+/* The posts with token, token_range gives it as a range for them. */
+static void token_range(uint64_t token, ss128_key_t *low, ss128_key_t *high)
+{
+	low->a = high->a = token;
+	low->b = 0;
+	high->b = UINT64_MAX;
+}
+
+typedef struct gram_scan_data {
+	const tag_t             *tag;
+	const regexp_literals_t *rl;
+	ss128_callback_t        callback;
+	void                    *data;
+} gram_scan_data_t;
+
+static void gram_scan_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	gram_scan_data_t  *data = data_;
+	const tag_value_t *tv = post_tag_value(value, data->tag);
+
+	if (!tv) return;
+	for (unsigned int i = 0; i < data->rl->of_lits; i++) {
+		if (!strstr(tv->v_str, data->rl->lits[i])) return;
+	}
+	data->callback(key, value, data->data);
+}
+
+static int gram_index_scan(const tag_t *tag, const char *re,
+                           ss128_callback_t callback, void *data)
+{
+	regexp_literals_t rl;
+	gram_scan_data_t  scan;
+	token_index_t     *ti;
+	char              *buf;
+	ss128_key_t       low, high;
+	uint64_t          rarest = 0;
+	unsigned int      best = 0;
+	int               found = 0;
+
+	buf = malloc(6 * strlen(re) + 1);
+	if (!buf) return 1;
+	if (regexp_literals(re, buf, &rl)) goto err;
+	ti = token_index_get(&gram_indexes, tag, gram_index_add);
+	if (!ti) goto err;
+	for (unsigned int i = 0; i < rl.of_lits; i++) {
+		for (const char *p = rl.lits[i]; p[0] && p[1] && p[2]; p++) {
+			const unsigned int count = token_count(ti, gram_key(p));
+			if (!found || count < best) {
+				rarest = gram_key(p);
+				best = count;
+				found = 1;
+			}
+		}
+	}
+	if (!found) goto err;
+	if (best) {
+		token_range(rarest, &low, &high);
+		scan.tag = tag;
+		scan.rl = &rl;
+		scan.callback = callback;
+		scan.data = data;
+		ss128_iterate_range(&ti->tokens, low, high, gram_scan_cb, &scan);
+	}
+	free(buf);
+	return 0;
+err:
+	free(buf);
+	return 1;
+}
+
+// More words than this are left to tv_cmp.
+#define SEARCH_WORDS 32
+
+typedef struct word_scan_data {
+	token_index_t    *ti;
+	uint64_t         words[SEARCH_WORDS];
+	unsigned int     of_words;
+	ss128_callback_t callback;
+	void             *data;
+} word_scan_data_t;
+
+static int word_scan_add_cb(const char *word, void *data_)
+{
+	word_scan_data_t *data = data_;
+	if (data->of_words < SEARCH_WORDS) {
+		data->words[data->of_words++] = str_key(word);
+	}
+	return 0;
+}
+
+static void word_scan_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	word_scan_data_t *data = data_;
+
+	for (unsigned int i = 0; i < data->of_words; i++) {
+		if (!token_has(data->ti, value, data->words[i])) return;
+	}
+	data->callback(key, value, data->data);
+}
+
+static int word_index_scan(const tag_t *tag, const char *words,
+                           ss128_callback_t callback, void *data)
+{
+	word_scan_data_t scan;
+	ss128_key_t      low, high;
+	unsigned int     best = 0, rarest = 0;
+
+	scan.of_words = 0;
+	if (utf_words(words, word_scan_add_cb, &scan) || !scan.of_words) {
+		return 1;
+	}
+	scan.ti = token_index_get(&word_indexes, tag, word_index_add);
+	if (!scan.ti) return 1;
+	for (unsigned int i = 0; i < scan.of_words; i++) {
+		const unsigned int count = token_count(scan.ti, scan.words[i]);
+		if (!i || count < best) {
+			best = count;
+			rarest = i;
+		}
+	}
+	if (!best) return 0;
+	token_range(scan.words[rarest], &low, &high);
+	scan.callback = callback;
+	scan.data = data;
+	ss128_iterate_range(&scan.ti->tokens, low, high, word_scan_cb, &scan);
+	return 0;
+}
+
+void value_index_forget(const tag_t *tag)
+{
+	value_index_drop(tag);
+	token_index_drop(&gram_indexes, tag);
+	token_index_drop(&word_indexes, tag);
+}
+
+static void token_index_change(ss128_head_t *registry, const tag_t *tag,
+                               post_t *post, const tag_value_t *old,
+                               const tag_value_t *new,
+                               token_index_add_t add,
+                               token_index_remove_t remove)
+{
+	token_index_t *ti = token_index_find(registry, tag);
+	if (!ti) return;
+	remove(ti, post, old);
+	if (add(ti, post, new)) token_index_drop(registry, tag);
+}
+
+/* Called for every change of the value of tag on post. old and new *
+ * are NULL when the post did not have, or no longer has, the tag.  */
+void value_index_change(const tag_t *tag, post_t *post,
+                        const tag_value_t *old, const tag_value_t *new)
+{
+	value_index_t *idx = value_index_find(tag);
+	column_change(tag, post, new);
+	token_index_change(&gram_indexes, tag, post, old, new,
+	                   gram_index_add, gram_index_remove);
+	token_index_change(&word_indexes, tag, post, old, new,
+	                   word_index_add, word_index_remove);
+	if (!idx) return;
+	value_index_remove(idx, post, old);
+	if (value_index_add(idx, post, new)) value_index_drop(tag);
+}
+
+static value_index_t *value_index_build(const tag_t *tag)
+{
+	const post_list_t *lists[] = {&tag->posts, &tag->weak_posts};
+	value_index_t *idx = calloc(1, sizeof(*idx));
+
+	if (!idx) return NULL;
+	ss128_init(&idx->tree, ss128_heap_alloc, ss128_heap_free, NULL);
+	idx->kind = index_kind(tag->valuetype);
+	if (ss128_insert(&indexes, idx, tag->guid.key)) goto err;
+	for (int l = 0; l < 2; l++) {
+		for (post_node_t *pn = lists[l]->head; pn; pn = pn->succ) {
+			if (value_index_add(idx, pn->post,
+			                    post_tag_value(pn->post, tag))
+			   ) {
+				value_index_drop(tag);
+				return NULL;
+			}
+		}
+	}
+	return idx;
+err:
+	ss128_free(&idx->tree);
+	free(idx);
+	return NULL;
+}
+
+static value_index_t *value_index_get(const tag_t *tag)
+{
+	value_index_t *idx = value_index_find(tag);
+	if (!idx) idx = value_index_build(tag);
+	return idx;
+}
+
+/* Whether value_index_scan can do this comparison. */
+int value_index_usable(const tag_t *tag, tagvalue_cmp_t cmp,
+                       const tag_value_t *val)
+{
+	const index_kind_t kind = index_kind(tag->valuetype);
+	if (kind == INDEX_STRING && cmp == CMP_REGEXP) {
+		return regexp_has_gram(val->v_str);
+	}
+	if (kind == INDEX_STRING && cmp == CMP_WORDS) return 1;
+	return kind != INDEX_NONE
+	       && cmp >= CMP_EQ && cmp <= CMP_LE
+	       && (kind != INDEX_STRING || cmp == CMP_EQ)
+	       && val->v_str != tag_value_null_marker;
+}
+
+typedef struct gps_scan_data {
+	ss128_callback_t callback;
+	void             *data;
+	double           unit[3];
+	double           min_dot; // -2 when not filtering
+} gps_scan_data_t;
+
+static void gps_scan_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	gps_scan_data_t   *data = data_;
+	const gps_entry_t *entry = value;
+	const double      dot = entry->unit[0] * data->unit[0]
+	                        + entry->unit[1] * data->unit[1]
+	                        + entry->unit[2] * data->unit[2];
+	if (dot < data->min_dot) return;
+	data->callback(key, entry->post, data->data);
+}
+
+/* For EQ posts within the fuzz of both positions, for LT and GT the *
+ * latitude half of the box comparison (the rest is left to tv_cmp). */
+static void gps_index_scan(value_index_t *idx, tagvalue_cmp_t cmp,
+                           const tag_value_t *val, ss128_callback_t callback,
+                           void *data)
+{
+	gps_scan_data_t scan;
+	ss128_key_t     low, high;
+	const double    lat = val->val.v_gps.lat;
+	const double    dist = val->fuzz.f_gps + idx->max_fuzz + GPS_SLACK;
+
+	scan.callback = callback;
+	scan.data = data;
+	scan.min_dot = -2;
+	gps_unit_vector(val->val.v_gps, scan.unit);
+	low.a  = 0;
+	low.b  = 0;
+	high.a = UINT64_MAX;
+	high.b = UINT64_MAX;
+	switch (cmp) {
+		case CMP_GT:
+		case CMP_GE:
+			low.a = double_key(lat - dist);
+			break;
+		case CMP_LT:
+		case CMP_LE:
+			high.a = double_key(lat + dist);
+			break;
+		default:
+			if (dist < M_PI) {
+				low.a = double_key(lat - dist);
+				high.a = double_key(lat + dist);
+				scan.min_dot = cos(dist) - GPS_SLACK;
+			}
+			break;
+	}
+	ss128_iterate_range(&idx->tree, low, high, gps_scan_cb, &scan);
+}
+
+typedef struct datetime_scan_data {
+	ss128_callback_t  callback;
+	void              *data;
+	const tag_t       *tag;
+	const tag_value_t *val;
+	tagvalue_cmp_t    cmp;
+	datetime_span_t   span;
+} datetime_scan_data_t;
+
+/* The same tests as tvc_datetime, on the span kept in the entry. EQ *
+ * only expands the steps when both spans overlap and one of them is *
+ * more than a single interval.                                      */
+static void datetime_scan_cb(ss128_key_t key, ss128_value_t value,
+                             void *data_)
+{
+	datetime_scan_data_t   *data = data_;
+	const datetime_entry_t *entry = value;
+	const datetime_span_t  *a = &entry->span;
+	const datetime_span_t  *b = &data->span;
+	int match;
+
+	switch (data->cmp) {
+		case CMP_GT:
+			match = a->high > b->low;
+			break;
+		case CMP_GE:
+			match = a->high >= b->low;
+			break;
+		case CMP_LT:
+			match = a->min_high < b->max_low;
+			break;
+		case CMP_LE:
+			match = a->min_high <= b->max_low;
+			break;
+		default:
+			match = a->low <= b->high && b->low <= a->high;
+			if (match && (a->low != a->max_low || a->high != a->min_high
+			              || b->low != b->max_low
+			              || b->high != b->min_high)
+			   ) {
+				const tag_value_t *tv;
+				tv = post_tag_value(entry->post, data->tag);
+				match = tvc_datetime(tv, CMP_EQ, data->val, NULL);
+			}
+			break;
+	}
+	if (match) data->callback(key, entry->post, data->data);
+}
+
+/* Whether the posts value_index_scan calls callback for are exactly *
+ * the ones that match, so the caller need not compare them again.   */
+int value_index_exact(const tag_t *tag, tagvalue_cmp_t cmp)
+{
+	return index_kind(tag->valuetype) == INDEX_DATETIME
+	       && cmp >= CMP_EQ && cmp <= CMP_LE;
+}
+
+/* Calls callback for (at least) every post on which the value of tag *
+ * compares to val as cmp, in index order. Returns 1 if there is no   *
+ * index for this comparison (and callback was not called).           */
+int value_index_scan(const tag_t *tag, tagvalue_cmp_t cmp,
+                     const tag_value_t *val, ss128_callback_t callback,
+                     void *data)
+{
+	value_index_t        *idx;
+	index_interval_t     iv;
+	ss128_key_t          low, high;
+	datetime_scan_data_t scan;
+
+	if (cmp == CMP_REGEXP && index_kind(tag->valuetype) == INDEX_STRING) {
+		return gram_index_scan(tag, val->v_str, callback, data);
+	}
+	if (cmp == CMP_WORDS && index_kind(tag->valuetype) == INDEX_STRING) {
+		return word_index_scan(tag, val->v_str, callback, data);
+	}
+	if (!value_index_usable(tag, cmp, val)) return 1;
+	idx = value_index_get(tag);
+	if (!idx) return 1;
+	if (idx->kind == INDEX_GPS) {
+		gps_index_scan(idx, cmp, val, callback, data);
+		return 0;
+	}
+	if (idx->kind == INDEX_DATETIME) {
+		scan.callback = callback;
+		scan.data     = data;
+		scan.tag      = tag;
+		scan.val      = val;
+		scan.cmp      = cmp;
+		datetime_span(val, &scan.span);
+		span_interval(&scan.span, &iv);
+		callback = datetime_scan_cb;
+		data     = &scan;
+	} else {
+		index_interval(idx->kind, val, &iv);
+	}
+	low.a  = 0;
+	low.b  = 0;
+	high.a = UINT64_MAX;
+	high.b = UINT64_MAX;
+	switch (cmp) {
+		case CMP_GT:
+		case CMP_GE: // high end >= low end of val
+			low.a = iv.low;
+			break;
+		case CMP_LT:
+		case CMP_LE: // lowest high end <= highest low end of val
+			high.a = UINT64_MAX;
+			if (iv.max_low <= UINT64_MAX - idx->max_spread) {
+				high.a = iv.max_low + idx->max_spread;
+			}
+			break;
+		default: // CMP_EQ, the intervals overlap
+			low.a = iv.low;
+			if (idx->kind == INDEX_DOUBLE) {
+				const double v = val->val.v_double;
+				const double f = val->fuzz.f_double;
+				double top = (f < 0 ? v - f : v + f) + DOUBLE_FF;
+				high.a = double_key(top + idx->max_width_d);
+				// A few ulps of slack for rounding in the width
+				if (high.a <= UINT64_MAX - 16) high.a += 16;
+			} else if (iv.high <= UINT64_MAX - idx->max_width) {
+				high.a = iv.high + idx->max_width;
+			}
+			break;
+	}
+	ss128_iterate_range(&idx->tree, low, high, callback, data);
+	return 0;
+}
+
+typedef struct distinct_value {
+	tag_value_t  *tv;
+	unsigned int count;
+} distinct_value_t;
+
+typedef struct distinct_data {
+	const tag_t         *tag;
+	value_distinct_cb_t callback;
+	void                *data;
+	uint64_t            key;
+	distinct_value_t    *values; // The values with this key
+	unsigned int        of_values;
+	unsigned int        room;
+	int                 error;
+} distinct_data_t;
+
+static void distinct_flush(distinct_data_t *data)
+{
+	for (unsigned int i = 0; i < data->of_values; i++) {
+		data->callback(data->values[i].tv, data->values[i].count,
+		               data->data);
+	}
+	data->of_values = 0;
+}
+
+static void distinct_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	distinct_data_t *data = data_;
+	tag_value_t     *tv = post_tag_value(value, data->tag);
+	unsigned int    i;
+
+	if (data->error || !tv) return;
+	if (key.a != data->key) distinct_flush(data);
+	data->key = key.a;
+	// Usually there is only one value per key.
+	for (i = 0; i < data->of_values; i++) {
+		if (!strcmp(data->values[i].tv->v_str, tv->v_str)) break;
+	}
+	if (i == data->of_values) {
+		if (i == data->room) {
+			unsigned int room = data->room * 2 + 4;
+			distinct_value_t *values;
+			values = realloc(data->values, room * sizeof(*values));
+			if (!values) {
+				data->error = 1;
+				return;
+			}
+			data->values = values;
+			data->room = room;
+		}
+		data->values[i].tv = tv;
+		data->values[i].count = 0;
+		data->of_values++;
+	}
+	data->values[i].count++;
+}
+
+/* Calls callback once for every distinct value of a word or string *
+ * tag, with how many posts have it, in no particular order.         */
+int value_index_distinct(const tag_t *tag, value_distinct_cb_t callback,
+                         void *data)
+{
+	distinct_data_t distinct;
+	value_index_t   *idx;
+
+	if (index_kind(tag->valuetype) != INDEX_STRING) return 1;
+	idx = value_index_get(tag);
+	if (!idx) return 1;
+	memset(&distinct, 0, sizeof(distinct));
+	distinct.tag = tag;
+	distinct.callback = callback;
+	distinct.data = data;
+	ss128_iterate(&idx->tree, distinct_cb, &distinct);
+	if (!distinct.error) distinct_flush(&distinct);
+	free(distinct.values);
+	return distinct.error;
+}
@@ -3,6 +3,10 @@
 #define listname(n) mem_ ## n
 #include "list.h"
 
+#undef listname
+#define listname(n) cursor_ ## n
+#include "list.h"
+
 #undef listname
 #define listname(n) post_ ## n
 #define LIST_ALL
@@ -34,7 +34,7 @@ typedef _ALIGN(struct logstat {
 }) logstat_t;
 
 #define MM_MAGIC0 0x4d4d0402 /* "MM^D^B" */
-#define MM_MAGIC1 0x4d4d001c /* Increment whenever cache should be discarded */
+#define MM_MAGIC1 0x4d4d001d /* Increment whenever cache should be discarded */
 #define MM_FLAG_CLEAN 1
 typedef _ALIGN(struct mm_head {
 	uint32_t      magic0;
@@ -50,6 +50,7 @@ typedef _ALIGN(struct mm_head {
 	uint64_t      first_logindex;
 	uint64_t      logdumpindex;
 	uint32_t      tag_guid_last[2];
+	uint32_t      post_ordinals;
 	ss128_head_t  posts;
 	ss128_head_t  tags;
 	ss128_head_t  tagaliases;
@@ -80,6 +81,7 @@ uint32_t *tag_guid_last;
 uint64_t *logindex;
 uint64_t *first_logindex;
 uint64_t *logdumpindex;
+uint32_t *post_ordinals;
 
 const char *tag_value_null_marker;
 const tag_value_t *tag_value_null;
@@ -404,6 +406,7 @@ int mm_init(void)
 	logindex      = &mm_head->logindex;
 	first_logindex= &mm_head->first_logindex;
 	logdumpindex  = &mm_head->logdumpindex;
+	post_ordinals = &mm_head->post_ordinals;
 	postlist_nodes = &mm_head->postlist_nodes;
 	tag_value_null_marker = &mm_head->tag_value_null_marker;
 	tag_value_null = &mm_head->tag_value_null;
@@ -97,6 +97,11 @@ static int put_enum_value_gen(uint16_t *res, const char * const *array,
 
 static void tag_delete(tag_t *tag)
 {
+	tag_render_forget(tag);
+	tag_stats_forget(tag);
+	value_index_forget(tag);
+	column_forget(tag);
+	search_cache_forget(tag);
 	ss128_key_t key = ss128_str2key(tag->name);
 	int r = ss128_delete(tags, key);
 	assert(!r);
@@ -108,6 +113,7 @@ static void post_delete(post_t *post)
 {
 	int r = ss128_delete(posts, post->md5.key);
 	assert(!r);
+	post_generation++;
 	// @@ We could reuse the post, but for now we just leak it.
 }
 
@@ -275,6 +281,7 @@ static int tag_cmd(connection_t *conn, char *cmd, void *data_,
 			if (put_enum_value_gen(&tag->type, tagtype_names, args)) {
 				return conn->error(conn, cmd);
 			}
+			tag_render_forget(tag);
 			break;
 		case 'M':
 			if (data->is_add || data->merge) {
@@ -302,6 +309,10 @@ static int tag_cmd(connection_t *conn, char *cmd, void *data_,
 				return conn->error(conn, cmd);
 			}
 			tag->valuetype = real_vt;
+			tag->generation++;
+			tag_render_forget(tag);
+			value_index_forget(tag);
+			column_forget(tag);
 			break;
 		case 'F':
 			u_value = 1;
@@ -313,6 +324,7 @@ static int tag_cmd(connection_t *conn, char *cmd, void *data_,
 				return conn->error(conn, cmd);
 			}
 			tag->unsettable = u_value;
+			tag_render_forget(tag);
 			data->flag_unsettable = 1;
 			break;
 		default:
@@ -345,6 +357,7 @@ static int tag_cmd(connection_t *conn, char *cmd, void *data_,
 		} else if (data->name && strcmp(data->name, tag->name)) {
 			r = ss128_delete(tags, key);
 			assert(!r);
+			tag_render_forget(tag);
 			tag->name = mm_strdup(data->name);
 			tag->fuzzy_name = utf_fuzz_mm(tag->name);
 			key = ss128_str2key(tag->name);
@@ -441,7 +454,7 @@ int prot_init(void) {
 static int do_magic_tag(post_t *post, tag_t *tag, const char *valp,
                         const field_t *field)
 {
-	tag_value_t tval;
+	tag_value_t tval, old;
 	tag_value_t *tval_p = post_tag_value(post, tag);
 	int add = 0;
 	if (!tval_p) {
@@ -449,6 +462,7 @@ static int do_magic_tag(post_t *post, tag_t *tag, const char *valp,
 		tval_p = &tval;
 		add = 1;
 	}
+	old = *tval_p;
 	if (field->is_fuzz) {
 		long long v = strtoull(valp, NULL, 16);
 		if (tval_p->fuzz.f_datetime.d_fuzz != -v) {
@@ -477,6 +491,7 @@ static int do_magic_tag(post_t *post, tag_t *tag, const char *valp,
 			if (tag_value_parse(tag, valp, tval_p, 0, 0)) return 1;
 		}
 	}
+	if (tval_p != &tval) post_tag_value_changed(post, tag, &old);
 	if (tag == magic_tag_rotate) {
 		if (tval_p->val.v_int == -1) { // Magic "unknown" value
 			if (!add) post_tag_rem(post, tag);
@@ -552,6 +567,7 @@ static int post_cmd(connection_t *conn, char *cmd, void *data,
 		if (r) {
 			return conn->error(conn, cmd);
 		}
+		post_generation++;
 		log_write_post(&conn->trans, post);
 	}
 	return 0;
@@ -583,6 +599,7 @@ int prot_add(connection_t *conn, char *cmd)
 			func = post_cmd;
 			data = mm_alloc(sizeof(post_t));
 			post_t *post = data;
+			post->ordinal = (*post_ordinals)++;
 			tag_value_t val;
 			memset(&val, 0, sizeof(val));
 			datetime_set_simple(&val.val.v_datetime, conn->trans.now);
@@ -909,6 +926,7 @@ static int order_cmd(connection_t *conn, char *cmd, void *data_,
 	if (!data->tag->ordered) {
 		// This tag was unordered, put first post first.
 		data->tag->ordered = 1;
+		tag_render_forget(data->tag);
 		post_remove(pl, pn);
 		post_addhead(pl, pn);
 	}
@@ -959,6 +977,7 @@ int prot_order(connection_t *conn, char *cmd)
 	if (!chk.ok) return conn->error(conn, cmd);
 	data.tag  = tag;
 	data.node = NULL;
+	tag->generation++;
 	log_set_init(&conn->trans, "O%s", cmd);
 	return prot_cmd_loop(conn, end + 1, &data, order_cmd, CMDFLAG_MODIFY);
 }
@@ -28,6 +28,22 @@ int ss128_init(ss128_head_t *head, ss128_allocmem_t allocmem, ss128_freemem_t fr
 	return 0;
 }
 
+/* Allocators for trees that live on the heap instead of in the mm cache. */
+int ss128_heap_alloc(void *data, void *res, unsigned int z)
+{
+	(void) data;
+	void *ptr = malloc(z);
+	memcpy(res, &ptr, sizeof(ptr));
+	return !ptr;
+}
+
+void ss128_heap_free(void *data, void *ptr, unsigned int z)
+{
+	(void) data;
+	(void) z;
+	free(ptr);
+}
+
 
 #define panic(bs, a) do_panic(a)
 static void do_panic(const char *msg) {
@@ -56,6 +72,28 @@ static int rbtree_key_lt(ss128_key_t a, ss128_key_t b) {
 	return 0;
 }
 
+static void ss128_iterate_range_i(ss128_node_t *node, ss128_key_t low,
+                                  ss128_key_t high, ss128_callback_t callback,
+                                  void *data) {
+	const int above_low  = !rbtree_key_lt(node->key, low);
+	const int below_high = !rbtree_key_lt(high, node->key);
+	if (above_low && node->child[0]) {
+		ss128_iterate_range_i(node->child[0], low, high, callback, data);
+	}
+	if (above_low && below_high) callback(node->key, node->value, data);
+	if (below_high && node->child[1]) {
+		ss128_iterate_range_i(node->child[1], low, high, callback, data);
+	}
+}
+
+/* In key order, only the keys from low to high (inclusive). */
+void ss128_iterate_range(ss128_head_t *head, ss128_key_t low,
+                         ss128_key_t high, ss128_callback_t callback,
+                         void *data) {
+	if (!head->root) return;
+	ss128_iterate_range_i(head->root, low, high, callback, data);
+}
+
 static int rbtree_key_eq(ss128_key_t a, ss128_key_t b) {
 	return a.a == b.a && a.b == b.b;
 }
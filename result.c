@@ -28,6 +28,69 @@ int result_add_post(connection_t *conn, result_t *result, post_t *post)
 	return 0;
 }
 
+/* Compiled regexps, keyed by the pattern. Searches and the filters of *
+ * implications use the same few patterns over and over, so each one  *
+ * is only compiled once. A returned regexp stays valid until the next *
+ * regex_cache_trim, which client_handle calls between commands.       */
+typedef struct regex_entry {
+	regex_t re;
+	int     bad;
+} regex_entry_t;
+
+#define REGEX_CACHE_MAX 256
+
+static ss128_head_t regex_cache;
+static unsigned int regex_cache_count = 0;
+static int          regex_cache_inited = 0;
+
+static void regex_cache_init(void)
+{
+	if (regex_cache_inited) return;
+	ss128_init(&regex_cache, ss128_heap_alloc, ss128_heap_free, NULL);
+	regex_cache_inited = 1;
+}
+
+/* NULL if pattern does not compile (or there is no memory). */
+regex_t *regex_cached(const char *pattern)
+{
+	const ss128_key_t key = ss128_str2key(pattern);
+	regex_entry_t *entry;
+
+	regex_cache_init();
+	if (!ss128_find(&regex_cache, (void *)&entry, key)) {
+		return entry->bad ? NULL : &entry->re;
+	}
+	entry = malloc(sizeof(*entry));
+	if (!entry) return NULL;
+	entry->bad = !!regcomp(&entry->re, pattern, REG_EXTENDED | REG_NOSUB);
+	if (ss128_insert(&regex_cache, entry, key)) {
+		if (!entry->bad) regfree(&entry->re);
+		free(entry);
+		return NULL;
+	}
+	regex_cache_count++;
+	return entry->bad ? NULL : &entry->re;
+}
+
+static void regex_free_cb(ss128_key_t key, ss128_value_t value, void *data)
+{
+	(void) key;
+	(void) data;
+	regex_entry_t *entry = (regex_entry_t *)value;
+	if (!entry->bad) regfree(&entry->re);
+	free(entry);
+}
+
+/* Throws everything away once the cache has grown too big. */
+void regex_cache_trim(void)
+{
+	if (regex_cache_count <= REGEX_CACHE_MAX) return;
+	ss128_iterate(&regex_cache, regex_free_cb, NULL);
+	ss128_free(&regex_cache);
+	regex_cache_inited = 0;
+	regex_cache_count = 0;
+}
+
 // The comparison functions return !0 for "match".
 
 int tvc_none(const tag_value_t *a, tagvalue_cmp_t cmp,
@@ -44,16 +107,11 @@ int tvc_string(const tag_value_t *a, tagvalue_cmp_t cmp,
                       const tag_value_t *b, regex_t *re)
 {
 	if (cmp == CMP_REGEXP) {
-		if (!re) {
-			regex_t re2;
-			if (regcomp(&re2, b->v_str, REG_EXTENDED | REG_NOSUB)) {
-				return 0;
-			}
-			int res = !regexec(&re2, a->v_str, 0, NULL, 0);
-			regfree(&re2);
-			return res;
-		}
+		if (!re) re = regex_cached(b->v_str);
+		if (!re) return 0;
 		return !regexec(re, a->v_str, 0, NULL, 0);
+	} else if (cmp == CMP_WORDS) {
+		return utf_has_words(a->v_str, b->v_str);
 	} else {
 		int eq = strcmp(a->v_str, b->v_str);
 		switch (cmp) {
@@ -165,11 +223,14 @@ tv_cmp_t *tv_cmp[] = {tvc_none, // NONE
                       tvc_gps, // GPS
                      };
 
+unsigned long tv_evaluations = 0;
+
 static int post_tv_if(const post_t *post, const search_tag_t *t, regex_t *re)
 {
 	const tagvalue_cmp_t cmp = t->cmp;
 	if (!cmp) return 1;
-	const tag_value_t *pval = post_tag_value(post, t->tag);
+	tv_evaluations++;
+	const tag_value_t *pval = post_column_value(post, t->tag);
 	if (!pval) {
 		return (cmp == CMP_EQ && t->val.v_str == tag_value_null_marker);
 	}
@@ -182,58 +243,337 @@ static int result_add_post_if(connection_t *conn, result_t *result,
 	return post_tv_if(post, t, re) && result_add_post(conn, result, post);
 }
 
+/* Numeric comparisons resolved once per search tag, so a block of    *
+ * posts is compared in one tight loop per comparison instead of      *
+ * through tv_cmp (and the switches in TVC_NUM) for every post. The   *
+ * arithmetic is the same as in TVC_NUM, with the interval of the     *
+ * searched value computed up front. Other types use post_tv_if.      */
+typedef enum {
+	PRED_NONE,
+	PRED_INT,
+	PRED_UINT,
+	PRED_DOUBLE,
+} pred_kind_t;
+
+typedef struct tv_pred {
+	pred_kind_t kind;
+	int64_t     i_low, i_high;
+	uint64_t    u_low, u_high;
+	double      d_low, d_high;
+} tv_pred_t;
+
+#define PRED_BLOCK 64
+
+// The operands are picked before adding, so the loops have no branches
+// and nothing is added that TVC_NUM would not add for this fuzz.
+#define PRED_INTERVAL(t, ft, ff, v, f, r_low, r_high)                          \
+	do {                                                                   \
+		const t  v_ = (v);                                             \
+		const ft f_ = (f);                                             \
+		const ft low_f  = f_ < 0 ? f_ : 0;                             \
+		const ft low_ff = f_ < 0 ? ff : 0;                             \
+		const ft high_f = f_ < 0 ? -f_ : f_;                           \
+		r_low  = v_ + low_f - low_ff;                                  \
+		r_high = v_ + high_f + ff;                                     \
+	} while (0)
+
+#define PRED_KERNEL(t, ft, ff, fn)                                             \
+	static void pred_kernel_##fn(tagvalue_cmp_t cmp, t b_low, t b_high,    \
+	                             const t *v, const ft *f, uint32_t count,  \
+	                             uint8_t *match)                           \
+	{                                                                      \
+		t low, high;                                                   \
+		uint32_t i;                                                    \
+		switch (cmp) {                                                 \
+			case CMP_EQ:                                           \
+				for (i = 0; i < count; i++) {                  \
+					PRED_INTERVAL(t, ft, ff, v[i], f[i],   \
+					              low, high);              \
+					match[i] = (low <= b_high)             \
+					           & (b_low <= high);          \
+				}                                              \
+				break;                                         \
+			case CMP_GT:                                           \
+				for (i = 0; i < count; i++) {                  \
+					PRED_INTERVAL(t, ft, ff, v[i], f[i],   \
+					              low, high);              \
+					match[i] = high > b_low;               \
+				}                                              \
+				break;                                         \
+			case CMP_GE:                                           \
+				for (i = 0; i < count; i++) {                  \
+					PRED_INTERVAL(t, ft, ff, v[i], f[i],   \
+					              low, high);              \
+					match[i] = high >= b_low;              \
+				}                                              \
+				break;                                         \
+			case CMP_LT:                                           \
+				for (i = 0; i < count; i++) {                  \
+					PRED_INTERVAL(t, ft, ff, v[i], f[i],   \
+					              low, high);              \
+					match[i] = high < b_low;               \
+				}                                              \
+				break;                                         \
+			case CMP_LE:                                           \
+				for (i = 0; i < count; i++) {                  \
+					PRED_INTERVAL(t, ft, ff, v[i], f[i],   \
+					              low, high);              \
+					match[i] = high <= b_low;              \
+				}                                              \
+				break;                                         \
+			default:                                               \
+				memset(match, 0, count);                       \
+				break;                                         \
+		}                                                              \
+		(void) low;                                                    \
+	}
+PRED_KERNEL(int64_t , int64_t, 0   , int)
+PRED_KERNEL(uint64_t, int64_t, 0   , uint)
+PRED_KERNEL(double  , double , 0.07, double)
+
+static void tv_pred_init(tv_pred_t *pred, const search_tag_t *t)
+{
+	const tag_value_t *b = &t->val;
+	pred->kind = PRED_NONE;
+	if (t->cmp < CMP_EQ || t->cmp > CMP_LE) return;
+	if (b->v_str == tag_value_null_marker) return;
+	switch (t->tag->valuetype) {
+		case VT_INT:
+			pred->kind = PRED_INT;
+			PRED_INTERVAL(int64_t, int64_t, 0, b->val.v_int,
+			              b->fuzz.f_int, pred->i_low, pred->i_high);
+			break;
+		case VT_UINT:
+			pred->kind = PRED_UINT;
+			PRED_INTERVAL(uint64_t, int64_t, 0, b->val.v_uint,
+			              b->fuzz.f_uint, pred->u_low, pred->u_high);
+			break;
+		case VT_FLOAT:
+		case VT_F_STOP:
+		case VT_STOP:
+			pred->kind = PRED_DOUBLE;
+			PRED_INTERVAL(double, double, 0.07, b->val.v_double,
+			              b->fuzz.f_double, pred->d_low, pred->d_high);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Bitmap of the (up to PRED_BLOCK) posts that have t and match its *
+ * comparison.                                                      */
+static uint64_t tv_pred_select(const tv_pred_t *pred, const search_tag_t *t,
+                               post_t * const *block, uint32_t count,
+                               regex_t *re)
+{
+	int64_t  v[PRED_BLOCK], f[PRED_BLOCK];
+	double   vd[PRED_BLOCK], fd[PRED_BLOCK];
+	uint8_t  match[PRED_BLOCK];
+	uint64_t has = 0, valid = 0, sel = 0;
+	uint32_t i;
+
+	assert(count <= PRED_BLOCK);
+	for (i = 0; i < count; i++) {
+		if (post_has_tag(block[i], t->tag, t->weak)) has |= 1ULL << i;
+	}
+	if (!t->cmp || !has) return has;
+	if (pred->kind == PRED_NONE) {
+		for (i = 0; i < count; i++) {
+			if (((has >> i) & 1) && post_tv_if(block[i], t, re)) {
+				sel |= 1ULL << i;
+			}
+		}
+		return sel;
+	}
+	for (i = 0; i < count; i++) {
+		const tag_value_t *tv = NULL;
+		v[i] = f[i] = 0;
+		vd[i] = fd[i] = 0;
+		if ((has >> i) & 1) {
+			tv_evaluations++;
+			tv = post_column_value(block[i], t->tag);
+		}
+		if (!tv || tv->v_str == tag_value_null_marker) continue;
+		valid |= 1ULL << i;
+		if (pred->kind == PRED_DOUBLE) {
+			vd[i] = tv->val.v_double;
+			fd[i] = tv->fuzz.f_double;
+		} else {
+			v[i] = tv->val.v_int;
+			f[i] = tv->fuzz.f_int;
+		}
+	}
+	switch (pred->kind) {
+		case PRED_INT:
+			pred_kernel_int(t->cmp, pred->i_low, pred->i_high,
+			                v, f, count, match);
+			break;
+		case PRED_UINT:
+			pred_kernel_uint(t->cmp, pred->u_low, pred->u_high,
+			                 (const uint64_t *)v, f, count, match);
+			break;
+		default:
+			pred_kernel_double(t->cmp, pred->d_low, pred->d_high,
+			                   vd, fd, count, match);
+			break;
+	}
+	for (i = 0; i < count; i++) sel |= (uint64_t)match[i] << i;
+	return sel & valid;
+}
+
 int result_remove_tag(connection_t *conn, result_t *result, search_tag_t *t)
+{
+	result_t  new_result;
+	regex_t   *re = NULL;
+	tv_pred_t pred;
+	int       res = 1;
+	uint32_t  i;
+
+	memset(&new_result, 0, sizeof(new_result));
+	if (t->cmp == CMP_REGEXP) {
+		re = regex_cached(t->val.v_str);
+		if (!re) return 1;
+	}
+	tv_pred_init(&pred, t);
+	for (i = 0; i < result->of_posts; i += PRED_BLOCK) {
+		post_t * const *block = result->posts + i;
+		uint32_t count = result->of_posts - i;
+		if (count > PRED_BLOCK) count = PRED_BLOCK;
+		const uint64_t sel = tv_pred_select(&pred, t, block, count, re);
+		for (uint32_t j = 0; j < count; j++) {
+			if (!((sel >> j) & 1)) {
+				err1(result_add_post(conn, &new_result, block[j]));
+			}
+		}
+	}
+	res = 0;
+err:
+	result_free(conn, result);
+	if (!res) *result = new_result;
+	return res;
+}
+
+static uint32_t post_ptr_hash(const post_t *post)
+{
+	return ((uint64_t)(uintptr_t)post * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* result_remove_tag as an anti-join: the posts on the lists of the tag *
+ * go in a hash set, and result is filtered against that. Cheaper than *
+ * post_has_tag on every post when the lists are short.                */
+int result_remove_list(connection_t *conn, result_t *result, search_tag_t *t)
 {
 	tag_t    *tag = t->tag;
-	truth_t  weak = t->weak;
 	result_t new_result;
-	regex_t  re;
+	regex_t  *re = NULL;
+	post_t   **set = NULL;
+	uint32_t count = 0;
+	uint32_t size;
 	int      res = 1;
-	uint32_t i;
 
+	if (t->weak != T_YES) count += tag->posts.count;
+	if (t->weak != T_NO) count += tag->weak_posts.count;
+	for (size = 16; size < count * 2; size *= 2);
 	memset(&new_result, 0, sizeof(new_result));
 	if (t->cmp == CMP_REGEXP) {
-		if (regcomp(&re, t->val.v_str, REG_EXTENDED | REG_NOSUB)) {
-			return 1;
-		}
+		re = regex_cached(t->val.v_str);
+		if (!re) return 1;
 	}
-	for (i = 0; i < result->of_posts; i++) {
-		post_t *post = result->posts[i];
-		if (!post_has_tag(post, tag, weak) || (t->cmp && !post_tv_if(post, t, &re))) {
-			err1(result_add_post(conn, &new_result, post));
+	err1(c_alloc(conn, (void **)&set, size * sizeof(post_t *)));
+	memset(set, 0, size * sizeof(post_t *));
+	for (int weak = 0; weak < 2; weak++) {
+		const post_list_t *pl = weak ? &tag->weak_posts : &tag->posts;
+		if (t->weak == (weak ? T_NO : T_YES)) continue;
+		for (const post_node_t *pn = pl->head; pn; pn = pn->succ) {
+			uint32_t i = post_ptr_hash(pn->post) & (size - 1);
+			if (t->cmp && !post_tv_if(pn->post, t, re)) continue;
+			while (set[i]) i = (i + 1) & (size - 1);
+			set[i] = pn->post;
 		}
 	}
+	for (uint32_t j = 0; j < result->of_posts; j++) {
+		post_t *post = result->posts[j];
+		uint32_t i = post_ptr_hash(post) & (size - 1);
+		while (set[i] && set[i] != post) i = (i + 1) & (size - 1);
+		if (!set[i]) err1(result_add_post(conn, &new_result, post));
+	}
+	result_free(conn, result);
+	*result = new_result;
 	res = 0;
 err:
-	result_free(conn, result);
-	if (t->cmp == CMP_REGEXP) regfree(&re);
-	if (!res) *result = new_result;
+	if (set) c_free(conn, set, size * sizeof(post_t *));
+	if (res) result_free(conn, &new_result);
 	return res;
 }
 
-int result_intersect(connection_t *conn, result_t *result, search_tag_t *t)
+typedef struct index_add_data {
+	connection_t       *conn;
+	result_t           *result;
+	const search_tag_t *t;
+	regex_t            *re;
+	int                exact; // The index did the comparison
+	int                error;
+} index_add_data_t;
+
+static void index_add_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	(void) key;
+	index_add_data_t *data = data_;
+	post_t *post = (post_t *)value;
+	const search_tag_t *t = data->t;
+	if (data->error) return;
+	if (t->weak != T_DONTCARE && !post_has_tag(post, t->tag, t->weak)) return;
+	if (data->exact || post_tv_if(post, t, data->re)) {
+		data->error = result_add_post(data->conn, data->result, post);
+	}
+}
+
+/* Intersects result with t, or starts it from t if result is empty. A  *
+ * start walks the value index if t has one for its comparison, unless *
+ * list_order asks for the posts in the order of the tag.              */
+int result_intersect(connection_t *conn, result_t *result, search_tag_t *t,
+                     int list_order)
 {
 	tag_t    *tag = t->tag;
 	truth_t  weak = t->weak;
 	result_t new_result;
-	regex_t  re;
+	regex_t  *re = NULL;
 
 	memset(&new_result, 0, sizeof(new_result));
 	if (t->cmp == CMP_REGEXP) {
-		if (regcomp(&re, t->val.v_str, REG_EXTENDED | REG_NOSUB)) {
-			return 1;
-		}
+		re = regex_cached(t->val.v_str);
+		if (!re) return 1;
 	}
 	if (result->of_posts) {
-		uint32_t i;
-		for (i = 0; i < result->of_posts; i++) {
-			post_t *post = result->posts[i];
-			if (post_has_tag(post, tag, weak)) {
-				err1(result_add_post_if(conn, &new_result, post, t, &re));
+		tv_pred_t pred;
+		tv_pred_init(&pred, t);
+		for (uint32_t i = 0; i < result->of_posts; i += PRED_BLOCK) {
+			post_t * const *block = result->posts + i;
+			uint32_t count = result->of_posts - i;
+			if (count > PRED_BLOCK) count = PRED_BLOCK;
+			const uint64_t sel = tv_pred_select(&pred, t, block,
+			                                    count, re);
+			for (uint32_t j = 0; j < count; j++) {
+				if (!((sel >> j) & 1)) continue;
+				err1(result_add_post(conn, &new_result,
+				                     block[j]));
 			}
 		}
 	} else {
+		index_add_data_t data;
 		post_node_t *pn;
+		data.conn   = conn;
+		data.result = &new_result;
+		data.t      = t;
+		data.re     = re;
+		data.exact  = value_index_exact(tag, t->cmp);
+		data.error  = 0;
+		if (!list_order
+		    && !value_index_scan(tag, t->cmp, &t->val, index_add_cb, &data)
+		   ) {
+			err1(data.error);
+			goto done;
+		}
 again:
 		if (weak) {
 			pn = tag->weak_posts.head;
@@ -241,7 +581,7 @@ again:
 			pn = tag->posts.head;
 		}
 		while (pn) {
-			err1(result_add_post_if(conn, &new_result, pn->post, t, &re));
+			err1(result_add_post_if(conn, &new_result, pn->post, t, re));
 			pn = pn->succ;
 		}
 		if (weak == T_DONTCARE) {
@@ -249,12 +589,450 @@ again:
 			goto again;
 		}
 	}
+done:
+	result_free(conn, result);
+	*result = new_result;
+	return 0;
+err:
+	result_free(conn, &new_result);
+	return 1;
+}
+
+typedef struct result_walk_data {
+	const search_tag_t *tags;
+	unsigned int       of_tags;
+	const search_tag_t *excluded;
+	unsigned int       of_excluded;
+	regex_t            **re;
+	result_walk_f      callback;
+	void               *cb_data;
+	int                exact; // The index did the first comparison
+	int                stop;
+} result_walk_data_t;
+
+static int post_matches(const post_t *post, const result_walk_data_t *data)
+{
+	for (unsigned int i = 0; i < data->of_tags; i++) {
+		const search_tag_t *t = &data->tags[i];
+		if (i && !post_has_tag(post, t->tag, t->weak)) return 0;
+		if ((i || !data->exact) && !post_tv_if(post, t, data->re[i])) {
+			return 0;
+		}
+	}
+	for (unsigned int i = 0; i < data->of_excluded; i++) {
+		const search_tag_t *t = &data->excluded[i];
+		if (post_has_tag(post, t->tag, t->weak)
+		    && post_tv_if(post, t, data->re[data->of_tags + i])
+		   ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void result_walk_cb(ss128_key_t key, ss128_value_t value, void *data_)
+{
+	(void) key;
+	result_walk_data_t *data = data_;
+	post_t *post = (post_t *)value;
+	if (!data->stop && post_matches(post, data)) {
+		data->stop = data->callback(post, data->cb_data);
+	}
+}
+
+static void result_walk_index_cb(ss128_key_t key, ss128_value_t value,
+                                 void *data_)
+{
+	(void) key;
+	result_walk_data_t *data = data_;
+	post_t *post = (post_t *)value;
+	const search_tag_t *t = data->tags;
+	if (data->stop) return;
+	if (t->weak != T_DONTCARE && !post_has_tag(post, t->tag, t->weak)) return;
+	if (post_matches(post, data)) {
+		data->stop = data->callback(post, data->cb_data);
+	}
+}
+
+static void result_walk_list(const post_list_t *pl, result_walk_data_t *data)
+{
+	for (const post_node_t *pn = pl->head; pn && !data->stop; pn = pn->succ) {
+		if (post_matches(pn->post, data)) {
+			data->stop = data->callback(pn->post, data->cb_data);
+		}
+	}
+}
+
+/* Call callback for each post a search matches, without building a   *
+ * result, until it returns non-zero. Walks the value index or the    *
+ * posting list of the first tag (or all posts if there are no        *
+ * positive tags), so posts come in the same order as                 *
+ * result_intersect would leave them with the same list_order.        */
+int result_walk(const search_tag_t *included, unsigned int of_tags,
+                const search_tag_t *excluded, unsigned int of_excluded,
+                int list_order, result_walk_f callback, void *cb_data)
+{
+	const unsigned int of_re = of_tags + of_excluded;
+	regex_t *re[of_re ? of_re : 1];
+	result_walk_data_t data;
+
+	data.tags        = included;
+	data.of_tags     = of_tags;
+	data.excluded    = excluded;
+	data.of_excluded = of_excluded;
+	data.re          = re;
+	data.callback    = callback;
+	data.cb_data     = cb_data;
+	data.exact       = 0;
+	data.stop        = 0;
+	for (unsigned int i = 0; i < of_re; i++) {
+		const search_tag_t *t = i < of_tags ? &included[i]
+		                                    : &excluded[i - of_tags];
+		re[i] = NULL;
+		if (t->cmp == CMP_REGEXP) {
+			re[i] = regex_cached(t->val.v_str);
+			if (!re[i]) return 1;
+		}
+	}
+	if (of_tags && !list_order) {
+		data.exact = value_index_exact(included->tag, included->cmp);
+	}
+	if (!of_tags) {
+		ss128_iterate(posts, result_walk_cb, &data);
+	} else if (list_order
+	           || value_index_scan(included->tag, included->cmp,
+	                               &included->val, result_walk_index_cb,
+	                               &data)
+	          ) { // No index, walk the lists
+		data.exact = 0;
+		if (included->weak != T_NO) {
+			result_walk_list(&included->tag->weak_posts, &data);
+		}
+		if (included->weak != T_YES) {
+			result_walk_list(&included->tag->posts, &data);
+		}
+	}
+	return 0;
+}
+
+/* The number of posts, if it can be had without walking them. */
+int result_quick_count(const search_tag_t *included, unsigned int of_tags,
+                       unsigned int of_excluded, uint32_t *r_count)
+{
+	if (of_tags != 1 || of_excluded || included->cmp) return 1;
+	*r_count = 0;
+	if (included->weak != T_YES) *r_count += included->tag->posts.count;
+	if (included->weak != T_NO) *r_count += included->tag->weak_posts.count;
+	return 0;
+}
+
+static int result_count_cb(post_t *post, void *data)
+{
+	(void) post;
+	(*(uint32_t *)data)++;
+	return 0;
+}
+
+int result_count(const search_tag_t *included, unsigned int of_tags,
+                 const search_tag_t *excluded, unsigned int of_excluded,
+                 uint32_t *r_count)
+{
+	if (!result_quick_count(included, of_tags, of_excluded, r_count)) {
+		return 0;
+	}
+	*r_count = 0;
+	return result_walk(included, of_tags, excluded, of_excluded, 0,
+	                   result_count_cb, r_count);
+}
+
+/* Set operations on results sorted by post pointer (result_sort_set). */
+static int sort_set_cmp(const void *a_, const void *b_, void *data)
+{
+	const post_t *a = *(const post_t * const *)a_;
+	const post_t *b = *(const post_t * const *)b_;
+	(void) data;
+	return (a > b) - (a < b);
+}
+
+void result_sort_set(result_t *result)
+{
+	sort(result->posts, result->of_posts, sizeof(post_t *), sort_set_cmp,
+	     NULL);
+}
+
+static int result_set_contains(const result_t *set, const post_t *post)
+{
+	uint32_t lo = 0, hi = set->of_posts;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (set->posts[mid] == post) return 1;
+		if (set->posts[mid] < post) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+/* Keep the posts of result that are in set, in the order they were. */
+int result_filter_set(connection_t *conn, result_t *result,
+                      const result_t *set)
+{
+	result_t new_result;
+	memset(&new_result, 0, sizeof(new_result));
+	for (uint32_t i = 0; i < result->of_posts; i++) {
+		post_t *post = result->posts[i];
+		if (result_set_contains(set, post)) {
+			err1(result_add_post(conn, &new_result, post));
+		}
+	}
 	result_free(conn, result);
-	if (t->cmp == CMP_REGEXP) regfree(&re);
 	*result = new_result;
 	return 0;
 err:
-	if (t->cmp == CMP_REGEXP) regfree(&re);
 	result_free(conn, &new_result);
 	return 1;
 }
+
+/* res = a | b (or a & b), all sorted sets. */
+int result_merge_sets(connection_t *conn, result_t *res, const result_t *a,
+                      const result_t *b, int intersect)
+{
+	uint32_t ai = 0, bi = 0;
+	memset(res, 0, sizeof(*res));
+	while (ai < a->of_posts && bi < b->of_posts) {
+		post_t *ap = a->posts[ai];
+		post_t *bp = b->posts[bi];
+		if (ap == bp) {
+			err1(result_add_post(conn, res, ap));
+			ai++;
+			bi++;
+		} else if (ap < bp) {
+			if (!intersect) err1(result_add_post(conn, res, ap));
+			ai++;
+		} else {
+			if (!intersect) err1(result_add_post(conn, res, bp));
+			bi++;
+		}
+	}
+	if (!intersect) {
+		for (; ai < a->of_posts; ai++) {
+			err1(result_add_post(conn, res, a->posts[ai]));
+		}
+		for (; bi < b->of_posts; bi++) {
+			err1(result_add_post(conn, res, b->posts[bi]));
+		}
+	}
+	return 0;
+err:
+	result_free(conn, res);
+	return 1;
+}
+
+/* Ranked searches. A post scores the weight of each rank tag it has,  *
+ * and the k best (ties by md5) are kept in a heap with the worst on   *
+ * top. Candidates already in result are all scored. Otherwise the    *
+ * lists of the rank tags are walked MaxScore style, heaviest first. A *
+ * post is only scored on the first list it is on, and lists are not   *
+ * walked at all once the weight left can't reach the k:th best score, *
+ * so popular tags with a low weight are usually never walked.         */
+typedef struct rank_entry {
+	post_t   *post;
+	uint32_t score;
+} rank_entry_t;
+
+typedef struct rank_data {
+	const rank_tag_t   *ranked;
+	unsigned int       of_ranked;
+	const search_tag_t *excluded;
+	unsigned int       of_excluded;
+	regex_t            **re;
+	rank_entry_t       *heap;
+	uint32_t           of_heap;
+	uint32_t           k;
+} rank_data_t;
+
+static uint32_t rank_list_count(const search_tag_t *t)
+{
+	uint32_t count = 0;
+	if (t->weak != T_YES) count += t->tag->posts.count;
+	if (t->weak != T_NO) count += t->tag->weak_posts.count;
+	return count;
+}
+
+static int sort_rank_tag(const void *a_, const void *b_, void *data)
+{
+	const rank_tag_t *a = a_;
+	const rank_tag_t *b = b_;
+	(void) data;
+	if (a->weight != b->weight) return a->weight > b->weight ? -1 : 1;
+	uint32_t ac = rank_list_count(&a->t);
+	uint32_t bc = rank_list_count(&b->t);
+	return (ac > bc) - (ac < bc);
+}
+
+static int rank_better(const rank_entry_t *a, const rank_entry_t *b)
+{
+	if (a->score != b->score) return a->score > b->score;
+	return memcmp(&a->post->md5, &b->post->md5, sizeof(md5_t)) < 0;
+}
+
+static int sort_rank_entry(const void *a_, const void *b_, void *data)
+{
+	(void) data;
+	if (rank_better(a_, b_)) return -1;
+	return rank_better(b_, a_);
+}
+
+static void rank_offer(rank_data_t *data, post_t *post, uint32_t score)
+{
+	rank_entry_t *heap = data->heap;
+	rank_entry_t e;
+	uint32_t     i;
+
+	e.post  = post;
+	e.score = score;
+	if (data->of_heap < data->k) {
+		for (i = data->of_heap++; i; i = (i - 1) / 2) {
+			if (!rank_better(&heap[(i - 1) / 2], &e)) break;
+			heap[i] = heap[(i - 1) / 2];
+		}
+		heap[i] = e;
+		return;
+	}
+	if (!rank_better(&e, &heap[0])) return;
+	i = 0;
+	for (;;) {
+		uint32_t c = 2 * i + 1;
+		if (c >= data->of_heap) break;
+		if (c + 1 < data->of_heap && rank_better(&heap[c], &heap[c + 1])) {
+			c++;
+		}
+		if (!rank_better(&e, &heap[c])) break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = e;
+}
+
+static int rank_has(const post_t *post, const rank_data_t *data,
+                    unsigned int i)
+{
+	const search_tag_t *t = &data->ranked[i].t;
+	return post_has_tag(post, t->tag, t->weak)
+	       && post_tv_if(post, t, data->re[i]);
+}
+
+static int rank_excluded(const post_t *post, const rank_data_t *data)
+{
+	for (unsigned int i = 0; i < data->of_excluded; i++) {
+		const search_tag_t *t = &data->excluded[i];
+		if (post_has_tag(post, t->tag, t->weak)
+		    && post_tv_if(post, t, data->re[data->of_ranked + i])
+		   ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint32_t rank_score(const post_t *post, const rank_data_t *data,
+                           unsigned int from)
+{
+	uint32_t score = 0;
+	for (unsigned int i = from; i < data->of_ranked; i++) {
+		if (rank_has(post, data, i)) score += data->ranked[i].weight;
+	}
+	return score;
+}
+
+static void rank_walk_list(const post_list_t *pl, rank_data_t *data,
+                           unsigned int i)
+{
+	for (const post_node_t *pn = pl->head; pn; pn = pn->succ) {
+		post_t *post = pn->post;
+		unsigned int j;
+		if (!post_tv_if(post, &data->ranked[i].t, data->re[i])) continue;
+		for (j = 0; j < i; j++) {
+			if (rank_has(post, data, j)) break;
+		}
+		if (j < i || rank_excluded(post, data)) continue;
+		rank_offer(data, post, data->ranked[i].weight
+		                       + rank_score(post, data, i + 1));
+	}
+}
+
+/* Replace result with the (at most) k best scoring posts, best first. *
+ * If result is empty the candidates come from the rank tags, and the *
+ * excluded tags are applied to them. ranked is reordered.            */
+int result_rank(connection_t *conn, result_t *result, rank_tag_t *ranked,
+                unsigned int of_ranked, const search_tag_t *excluded,
+                unsigned int of_excluded, uint32_t k)
+{
+	const unsigned int of_re = of_ranked + of_excluded;
+	regex_t     *re[of_re ? of_re : 1];
+	rank_data_t data;
+	result_t    new_result;
+	uint32_t    left[of_ranked + 1];
+	uint64_t    bound = 0;
+	int         res = 1;
+
+	memset(&new_result, 0, sizeof(new_result));
+	sort(ranked, of_ranked, sizeof(*ranked), sort_rank_tag, NULL);
+	left[of_ranked] = 0;
+	for (unsigned int i = of_ranked; i--;) {
+		left[i] = left[i + 1] + ranked[i].weight;
+		bound += rank_list_count(&ranked[i].t);
+	}
+	if (result->of_posts) bound = result->of_posts;
+	if (k > bound) k = bound;
+	data.ranked      = ranked;
+	data.of_ranked   = of_ranked;
+	data.excluded    = excluded;
+	data.of_excluded = of_excluded;
+	data.re          = re;
+	data.heap        = NULL;
+	data.of_heap     = 0;
+	data.k           = k;
+	for (unsigned int i = 0; i < of_re; i++) {
+		const search_tag_t *t = i < of_ranked ? &ranked[i].t
+		                                      : &excluded[i - of_ranked];
+		re[i] = NULL;
+		if (t->cmp == CMP_REGEXP) {
+			re[i] = regex_cached(t->val.v_str);
+			if (!re[i]) goto err;
+		}
+	}
+	if (!k) goto done;
+	if (c_alloc(conn, (void **)&data.heap, k * sizeof(rank_entry_t))) {
+		goto err;
+	}
+	if (result->of_posts) {
+		for (uint32_t i = 0; i < result->of_posts; i++) {
+			post_t *post = result->posts[i];
+			uint32_t score = rank_score(post, &data, 0);
+			if (score) rank_offer(&data, post, score);
+		}
+	} else {
+		for (unsigned int i = 0; i < of_ranked; i++) {
+			const search_tag_t *t = &ranked[i].t;
+			if (data.of_heap == k && left[i] < data.heap[0].score) break;
+			if (t->weak != T_NO) rank_walk_list(&t->tag->weak_posts, &data, i);
+			if (t->weak != T_YES) rank_walk_list(&t->tag->posts, &data, i);
+		}
+	}
+	sort(data.heap, data.of_heap, sizeof(rank_entry_t), sort_rank_entry,
+	     NULL);
+	for (uint32_t i = 0; i < data.of_heap; i++) {
+		err1(result_add_post(conn, &new_result, data.heap[i].post));
+	}
+done:
+	result_free(conn, result);
+	*result = new_result;
+	res = 0;
+err:
+	if (data.heap) c_free(conn, data.heap, k * sizeof(rank_entry_t));
+	if (res) result_free(conn, &new_result);
+	return res;
+}
@@ -205,6 +205,9 @@ int main(int argc, char **argv)
 	db_serve();
 	printf("Cleaning up mm..\n");
 	conn_cleanup();
+	printf("Connection memory high-water mark: %u bytes.\n", c_mem_high);
+	printf("Search cache: %lu hits, %lu misses.\n", search_cache_hits,
+	       search_cache_misses);
 	log_cleanup();
 	mm_cleanup();
 	return 0;
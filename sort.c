@@ -1,42 +1,567 @@
-/* Merge sort, but can be replaced by any stable sort. */
-/* Could undoubtedly be sped up by stoping partitioning sooner. */
-/* May not be optimal to duplicate the left array. */
+/* Stable sort: natural runs (extended to a minimum length with binary *
+ * insertion sort) merged timsort style, galloping when one side keeps *
+ * winning. Merges use a heap scratch buffer the size of the smaller   *
+ * run, falling back to in-place rotation merges if that fails.        */
 
 #include "db.h"
 
 #define ELEM(a, e) (((char *)(a)) + (size * (e)))
-static void sort_merge(void *left, int left_nmemb, void *right, int right_nmemb,
-                       size_t size, sort_compar_t comp, void *data)
-{
-	void *base = left;
-	char left_copy[left_nmemb * size];
-	memcpy(left_copy, left, sizeof(left_copy));
-	left = left_copy;
-	int li = 0, ri = 0, i = 0;
-	while (li < left_nmemb && ri < right_nmemb) {
-		int c = comp(ELEM(left, li), ELEM(right, ri), data);
-		if (c <= 0) {
-			memcpy(ELEM(base, i), ELEM(left, li), size);
-			i++;
-			li++;
+
+#define SORT_MIN_GALLOP 7
+#define SORT_MAX_RUNS   64
+
+typedef struct sort_state {
+	char          *base;
+	size_t        size;
+	sort_compar_t comp;
+	void          *data;
+	char          *tmp;
+	size_t        tmp_nmemb;
+	int           min_gallop;
+	int           of_runs;
+	int           run_start[SORT_MAX_RUNS];
+	int           run_len[SORT_MAX_RUNS];
+} sort_state_t;
+
+static void sort_reverse(char *a, int nmemb, size_t size)
+{
+	char t[size];
+	for (int lo = 0, hi = nmemb - 1; lo < hi; lo++, hi--) {
+		memcpy(t, ELEM(a, lo), size);
+		memcpy(ELEM(a, lo), ELEM(a, hi), size);
+		memcpy(ELEM(a, hi), t, size);
+	}
+}
+
+static void sort_rotate(char *a, int left_nmemb, int nmemb, size_t size)
+{
+	sort_reverse(a, left_nmemb, size);
+	sort_reverse(ELEM(a, left_nmemb), nmemb - left_nmemb, size);
+	sort_reverse(a, nmemb, size);
+}
+
+/* Sort a[0..nmemb), of which a[0..sorted) is already sorted. */
+static void sort_binary_insertion(sort_state_t *s, char *a, int nmemb,
+                                  int sorted)
+{
+	size_t size = s->size;
+	char pivot[size];
+	for (int i = sorted; i < nmemb; i++) {
+		int lo = 0, hi = i;
+		memcpy(pivot, ELEM(a, i), size);
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (s->comp(pivot, ELEM(a, mid), s->data) < 0) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+		memmove(ELEM(a, lo + 1), ELEM(a, lo), (i - lo) * size);
+		memcpy(ELEM(a, lo), pivot, size);
+	}
+}
+
+/* Length of the run at the start of a, made ascending. */
+static int sort_count_run(sort_state_t *s, char *a, int nmemb)
+{
+	size_t size = s->size;
+	int n = 1;
+	if (nmemb < 2) return nmemb;
+	if (s->comp(ELEM(a, 1), a, s->data) < 0) {
+		// Strictly descending, so reversing keeps it stable.
+		for (n = 2; n < nmemb; n++) {
+			if (s->comp(ELEM(a, n), ELEM(a, n - 1), s->data) >= 0) break;
+		}
+		sort_reverse(a, n, size);
+	} else {
+		for (n = 2; n < nmemb; n++) {
+			if (s->comp(ELEM(a, n), ELEM(a, n - 1), s->data) < 0) break;
+		}
+	}
+	return n;
+}
+
+static int sort_min_run(int n)
+{
+	int r = 0;
+	while (n >= 64) {
+		r |= n & 1;
+		n >>= 1;
+	}
+	return n + r;
+}
+
+/* Where key goes in sorted a[0..nmemb): before equal elements with    *
+ * left set, after them otherwise. Gallops from hint, then bisects.    */
+static int sort_gallop(sort_state_t *s, const void *key, char *a, int nmemb,
+                       int hint, int left)
+{
+	size_t size = s->size;
+	int lo, hi;
+#define KEY_AFTER(i) (left ? s->comp(key, ELEM(a, i), s->data) > 0 \
+                           : s->comp(key, ELEM(a, i), s->data) >= 0)
+	if (KEY_AFTER(hint)) {
+		int last = hint, ofs = 1;
+		while (hint + ofs < nmemb && KEY_AFTER(hint + ofs)) {
+			last = hint + ofs;
+			ofs = ofs * 2 + 1;
+		}
+		lo = last + 1;
+		hi = hint + ofs < nmemb ? hint + ofs : nmemb;
+	} else {
+		int last = hint, ofs = 1;
+		while (hint - ofs >= 0 && !KEY_AFTER(hint - ofs)) {
+			last = hint - ofs;
+			ofs = ofs * 2 + 1;
+		}
+		lo = hint - ofs >= 0 ? hint - ofs + 1 : 0;
+		hi = last;
+	}
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (KEY_AFTER(mid)) {
+			lo = mid + 1;
 		} else {
-			void *dest = ELEM(base, i);
-			void *src = ELEM(right, ri);
-			if (dest == src) break;
-			memcpy(dest, src, size);
-			i++;
-			ri++;
+			hi = mid;
+		}
+	}
+#undef KEY_AFTER
+	return lo;
+}
+
+static int sort_tmp(sort_state_t *s, int nmemb)
+{
+	if (s->tmp_nmemb >= (size_t)nmemb) return 0;
+	char *tmp = realloc(s->tmp, nmemb * s->size);
+	if (!tmp) return 1;
+	s->tmp = tmp;
+	s->tmp_nmemb = nmemb;
+	return 0;
+}
+
+/* Merge a[0..na) and b = a[na..na+nb) where na <= nb, left to right */
+static void sort_merge_lo(sort_state_t *s, char *a, int na, int nb)
+{
+	size_t size = s->size;
+	char *dest = a;
+	char *l = s->tmp;
+	char *r = ELEM(a, na);
+	memcpy(l, a, na * size);
+	while (na && nb) {
+		int lwins = 0, rwins = 0;
+		while (na && nb && (lwins | rwins) < s->min_gallop) {
+			if (s->comp(r, l, s->data) < 0) {
+				memmove(dest, r, size);
+				r += size;
+				nb--;
+				rwins++;
+				lwins = 0;
+			} else {
+				memcpy(dest, l, size);
+				l += size;
+				na--;
+				lwins++;
+				rwins = 0;
+			}
+			dest += size;
+		}
+		while (na && nb) {
+			int n = sort_gallop(s, r, l, na, 0, 0);
+			memcpy(dest, l, n * size);
+			dest += n * size;
+			l += n * size;
+			na -= n;
+			if (!na) break;
+			int m = sort_gallop(s, l, r, nb, 0, 1);
+			memmove(dest, r, m * size);
+			dest += m * size;
+			r += m * size;
+			nb -= m;
+			if (n < SORT_MIN_GALLOP && m < SORT_MIN_GALLOP) {
+				s->min_gallop++;
+				break;
+			}
+			if (s->min_gallop > 1) s->min_gallop--;
+		}
+	}
+	memcpy(dest, l, na * size);
+}
+
+/* Merge a[0..na) and b = a[na..na+nb) where na > nb, right to left */
+static void sort_merge_hi(sort_state_t *s, char *a, int na, int nb)
+{
+	size_t size = s->size;
+	char *dest = ELEM(a, na + nb);
+	char *l = ELEM(a, na);     // one past the end of the left run
+	char *r = s->tmp + nb * size;
+	memcpy(s->tmp, ELEM(a, na), nb * size);
+	while (na && nb) {
+		int lwins = 0, rwins = 0;
+		while (na && nb && (lwins | rwins) < s->min_gallop) {
+			if (s->comp(r - size, l - size, s->data) < 0) {
+				l -= size;
+				dest -= size;
+				memmove(dest, l, size);
+				na--;
+				lwins++;
+				rwins = 0;
+			} else {
+				r -= size;
+				dest -= size;
+				memcpy(dest, r, size);
+				nb--;
+				rwins++;
+				lwins = 0;
+			}
+		}
+		while (na && nb) {
+			// Elements of the left run that go after r[-1]
+			int n = na - sort_gallop(s, r - size, l - na * size, na,
+			                         na - 1, 0);
+			l -= n * size;
+			dest -= n * size;
+			memmove(dest, l, n * size);
+			na -= n;
+			if (!na) break;
+			// Elements of the right run that go after l[-1]
+			int m = nb - sort_gallop(s, l - size, s->tmp, nb,
+			                         nb - 1, 1);
+			r -= m * size;
+			dest -= m * size;
+			memcpy(dest, r, m * size);
+			nb -= m;
+			if (n < SORT_MIN_GALLOP && m < SORT_MIN_GALLOP) {
+				s->min_gallop++;
+				break;
+			}
+			if (s->min_gallop > 1) s->min_gallop--;
+		}
+	}
+	memcpy(dest - nb * size, s->tmp, nb * size);
+}
+
+/* Stable merge without a buffer, by rotation. */
+static void sort_merge_inplace(sort_state_t *s, char *a, int na, int nb)
+{
+	size_t size = s->size;
+	if (!na || !nb) return;
+	if (na + nb == 2) {
+		if (s->comp(ELEM(a, 1), a, s->data) < 0) sort_rotate(a, 1, 2, size);
+		return;
+	}
+	int cut_a, cut_b;
+	if (na >= nb) {
+		cut_a = na / 2;
+		cut_b = sort_gallop(s, ELEM(a, cut_a), ELEM(a, na), nb, 0, 1);
+	} else {
+		cut_b = nb / 2;
+		cut_a = sort_gallop(s, ELEM(a, na + cut_b), a, na, 0, 0);
+	}
+	sort_rotate(ELEM(a, cut_a), na - cut_a, na - cut_a + cut_b, size);
+	sort_merge_inplace(s, a, cut_a, cut_b);
+	sort_merge_inplace(s, ELEM(a, cut_a + cut_b), na - cut_a, nb - cut_b);
+}
+
+static void sort_merge_at(sort_state_t *s, int i)
+{
+	size_t size = s->size;
+	char *a = ELEM(s->base, s->run_start[i]);
+	int na = s->run_len[i];
+	int nb = s->run_len[i + 1];
+	char *b = ELEM(a, na);
+
+	s->run_len[i] = na + nb;
+	if (i == s->of_runs - 3) {
+		s->run_start[i + 1] = s->run_start[i + 2];
+		s->run_len[i + 1] = s->run_len[i + 2];
+	}
+	s->of_runs--;
+
+	// Parts already in place need not be merged.
+	int k = sort_gallop(s, b, a, na, 0, 0);
+	a += k * size;
+	na -= k;
+	if (!na) return;
+	nb = sort_gallop(s, ELEM(a, na - 1), b, nb, nb - 1, 1);
+	if (!nb) return;
+	if (sort_tmp(s, na < nb ? na : nb)) {
+		sort_merge_inplace(s, a, na, nb);
+	} else if (na <= nb) {
+		sort_merge_lo(s, a, na, nb);
+	} else {
+		sort_merge_hi(s, a, na, nb);
+	}
+}
+
+/* Keep run lengths decreasing faster than Fibonacci, so the stack *
+ * stays shallow and merges stay balanced.                         */
+static void sort_merge_collapse(sort_state_t *s)
+{
+	while (s->of_runs > 1) {
+		int n = s->of_runs - 2;
+		int *len = s->run_len;
+		if ((n > 0 && len[n - 1] <= len[n] + len[n + 1])
+		    || (n > 1 && len[n - 2] <= len[n - 1] + len[n])
+		   ) {
+			if (len[n - 1] < len[n + 1]) n--;
+		} else if (len[n] > len[n + 1]) {
+			break;
 		}
+		sort_merge_at(s, n);
 	}
-	memcpy(ELEM(base, i), ELEM(left, li), size * (left_nmemb - li));
 }
 
 void sort(void *base, int nmemb, size_t size, sort_compar_t comp, void *data)
 {
-	char *cbase = base;
+	sort_state_t s;
 	if (nmemb < 2) return;
-	sort(base, nmemb / 2, size, comp, data);
-	cbase += size * (nmemb / 2);
-	sort(cbase, (nmemb + 1) / 2, size, comp, data);
-	sort_merge(base, nmemb / 2, cbase, (nmemb + 1) / 2, size, comp, data);
+	s.base       = base;
+	s.size       = size;
+	s.comp       = comp;
+	s.data       = data;
+	s.tmp        = NULL;
+	s.tmp_nmemb  = 0;
+	s.min_gallop = SORT_MIN_GALLOP;
+	s.of_runs    = 0;
+	int min_run = sort_min_run(nmemb);
+	int lo = 0;
+	while (lo < nmemb) {
+		char *a = ELEM(base, lo);
+		int left = nmemb - lo;
+		int n = sort_count_run(&s, a, left);
+		if (n < min_run) {
+			int forced = left < min_run ? left : min_run;
+			sort_binary_insertion(&s, a, forced, n);
+			n = forced;
+		}
+		s.run_start[s.of_runs] = lo;
+		s.run_len[s.of_runs] = n;
+		s.of_runs++;
+		sort_merge_collapse(&s);
+		lo += n;
+	}
+	while (s.of_runs > 1) {
+		int n = s.of_runs - 2;
+		if (n > 0 && s.run_len[n - 1] < s.run_len[n + 1]) n--;
+		sort_merge_at(&s, n);
+	}
+	free(s.tmp);
+}
+
+/* Partial sort: [start, end) of base ends up as a full (stable) sort  *
+ * would leave it, the rest of base holds the other elements in no     *
+ * particular order. Works on an index array, with ties broken on the  *
+ * original position to keep it stable.                                */
+typedef struct sort_idx {
+	const char    *base;
+	size_t        size;
+	sort_compar_t comp;
+	void          *data;
+} sort_idx_t;
+
+static int sort_idx_cmp(const sort_idx_t *s, int a, int b)
+{
+	int c = s->comp(s->base + s->size * a, s->base + s->size * b, s->data);
+	if (c) return c;
+	return (a > b) - (a < b);
+}
+
+static void sort_idx_swap(int *idx, int a, int b)
+{
+	int t = idx[a];
+	idx[a] = idx[b];
+	idx[b] = t;
+}
+
+/* Max-heap of nmemb indices */
+static void sort_heap_down(const sort_idx_t *s, int *idx, int nmemb, int i)
+{
+	while (1) {
+		int largest = i;
+		int l = 2 * i + 1;
+		int r = l + 1;
+		if (l < nmemb && sort_idx_cmp(s, idx[l], idx[largest]) > 0) {
+			largest = l;
+		}
+		if (r < nmemb && sort_idx_cmp(s, idx[r], idx[largest]) > 0) {
+			largest = r;
+		}
+		if (largest == i) return;
+		sort_idx_swap(idx, i, largest);
+		i = largest;
+	}
+}
+
+static void sort_heap(const sort_idx_t *s, int *idx, int nmemb)
+{
+	for (int i = nmemb / 2 - 1; i >= 0; i--) {
+		sort_heap_down(s, idx, nmemb, i);
+	}
+	for (int i = nmemb - 1; i > 0; i--) {
+		sort_idx_swap(idx, 0, i);
+		sort_heap_down(s, idx, i, 0);
+	}
+}
+
+/* The end smallest of nmemb, sorted, into idx[0..end). */
+static void sort_heap_select(const sort_idx_t *s, int *idx, int nmemb, int end)
+{
+	for (int i = 0; i < end; i++) idx[i] = i;
+	for (int i = end / 2 - 1; i >= 0; i--) {
+		sort_heap_down(s, idx, end, i);
+	}
+	for (int i = end; i < nmemb; i++) {
+		if (sort_idx_cmp(s, i, idx[0]) < 0) {
+			idx[0] = i;
+			sort_heap_down(s, idx, end, 0);
+		}
+	}
+	sort_heap(s, idx, end);
+}
+
+/* Introselect: partition idx so that idx[k] is in its sorted position, *
+ * with nothing larger before it and nothing smaller after it. Falls    *
+ * back to heapsort of the remaining range if partitioning goes badly.  */
+static void sort_select(const sort_idx_t *s, int *idx, int lo, int hi, int k)
+{
+	int depth = 0;
+	for (int n = hi - lo; n > 1; n >>= 1) depth += 2;
+	while (hi - lo > 1) {
+		if (!depth--) {
+			sort_heap(s, idx + lo, hi - lo);
+			return;
+		}
+		int mid = lo + (hi - lo) / 2;
+		int last = hi - 1;
+		// Median of three, moved to the end as the pivot
+		if (sort_idx_cmp(s, idx[mid], idx[lo]) < 0) {
+			sort_idx_swap(idx, mid, lo);
+		}
+		if (sort_idx_cmp(s, idx[last], idx[lo]) < 0) {
+			sort_idx_swap(idx, last, lo);
+		}
+		if (sort_idx_cmp(s, idx[last], idx[mid]) < 0) {
+			sort_idx_swap(idx, last, mid);
+		}
+		sort_idx_swap(idx, mid, last);
+		int pivot = idx[last];
+		int store = lo;
+		for (int i = lo; i < last; i++) {
+			if (sort_idx_cmp(s, idx[i], pivot) < 0) {
+				sort_idx_swap(idx, i, store++);
+			}
+		}
+		sort_idx_swap(idx, store, last);
+		if (store == k) return;
+		if (k < store) {
+			hi = store;
+		} else {
+			lo = store + 1;
+		}
+	}
+}
+
+void sort_partial(void *base, int nmemb, int start, int end, size_t size,
+                  sort_compar_t comp, void *data)
+{
+	sort_idx_t s = {base, size, comp, data};
+	int *idx;
+
+	if (end > nmemb) end = nmemb;
+	if (start >= end) return;
+	idx = malloc((end * 8 <= nmemb ? end : nmemb) * sizeof(int));
+	if (!idx) {
+		sort(base, nmemb, size, comp, data);
+		return;
+	}
+	if (end * 8 <= nmemb) {
+		sort_heap_select(&s, idx, nmemb, end);
+	} else {
+		for (int i = 0; i < nmemb; i++) idx[i] = i;
+		if (start) sort_select(&s, idx, 0, nmemb, start);
+		if (end < nmemb) sort_select(&s, idx, start, nmemb, end);
+		sort_heap(&s, idx + start, end - start);
+	}
+	// Swap the window into place. An element that started in the part
+	// of the window already done was swapped away, to where idx[] of
+	// that position now says, so follow that until it leads outside.
+	char t[size];
+	for (int i = start; i < end; i++) {
+		int p = idx[i];
+		while (p >= start && p < i) p = idx[p];
+		if (p != i) {
+			memcpy(t, ELEM(base, i), size);
+			memcpy(ELEM(base, i), ELEM(base, p), size);
+			memcpy(ELEM(base, p), t, size);
+		}
+		idx[i] = p;
+	}
+	free(idx);
+}
+
+/* LSD radix sort on a 64 bit key per element, for orders that reduce *
+ * to an integer. Bytes that are the same in every key are skipped.   *
+ * Runs of equal keys are then sorted with comp, so the key only      *
+ * needs to be a prefix of the full ordering.                         */
+void sort_radix(void *base, int nmemb, size_t size, sort_key_t key,
+                sort_compar_t comp, void *data)
+{
+	uint32_t (*count)[256] = calloc(8, sizeof(*count));
+	uint64_t *keys_mem = malloc(nmemb * 2 * sizeof(uint64_t));
+	uint32_t *idx_mem = malloc(nmemb * 2 * sizeof(uint32_t));
+	char     *tmp = malloc(nmemb * size);
+
+	if (!count || !keys_mem || !idx_mem || !tmp) {
+		sort(base, nmemb, size, comp, data);
+		goto done;
+	}
+	uint64_t *keys = keys_mem, *keys2 = keys_mem + nmemb;
+	uint32_t *idx = idx_mem, *idx2 = idx_mem + nmemb;
+	for (int i = 0; i < nmemb; i++) {
+		uint64_t k = key(ELEM(base, i), data);
+		keys[i] = k;
+		idx[i] = i;
+		for (int b = 0; b < 8; b++) {
+			count[b][(k >> (b * 8)) & 0xff]++;
+		}
+	}
+	for (int b = 0; b < 8; b++) {
+		uint32_t *c = count[b];
+		int shift = b * 8;
+		if (c[(keys[0] >> shift) & 0xff] == (uint32_t)nmemb) continue;
+		uint32_t pos = 0;
+		for (int i = 0; i < 256; i++) {
+			uint32_t n = c[i];
+			c[i] = pos;
+			pos += n;
+		}
+		for (int i = 0; i < nmemb; i++) {
+			uint32_t d = c[(keys[i] >> shift) & 0xff]++;
+			keys2[d] = keys[i];
+			idx2[d] = idx[i];
+		}
+		uint64_t *kt = keys;
+		keys = keys2;
+		keys2 = kt;
+		uint32_t *it = idx;
+		idx = idx2;
+		idx2 = it;
+	}
+	for (int i = 0; i < nmemb; i++) {
+		memcpy(ELEM(tmp, i), ELEM(base, idx[i]), size);
+	}
+	memcpy(base, tmp, nmemb * size);
+	int start = 0;
+	for (int i = 1; i <= nmemb; i++) {
+		if (i == nmemb || keys[i] != keys[start]) {
+			sort(ELEM(base, start), i - start, size, comp, data);
+			start = i;
+		}
+	}
+done:
+	free(count);
+	free(keys_mem);
+	free(idx_mem);
+	free(tmp);
 }
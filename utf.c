@@ -113,6 +113,22 @@ const char *utf_fuzz_mm(const char *str)
 	return res;
 }
 
+/* Pure ASCII is already normalised. Checks a word at a time. */
+int utf_is_ascii(const char *str, unsigned int len)
+{
+	const char *end = str + len;
+	while (end - str >= 8) {
+		uint64_t w;
+		memcpy(&w, str, sizeof(w));
+		if (w & 0x8080808080808080ULL) return 0;
+		str += 8;
+	}
+	while (str < end) {
+		if (*str++ & 0x80) return 0;
+	}
+	return 1;
+}
+
 char *utf_compose(connection_t *conn, const char *str, int len)
 {
 	uint8_t *buf;
@@ -127,3 +143,89 @@ char *utf_compose(connection_t *conn, const char *str, int len)
 	}
 	return (char *)buf;
 }
+
+/* Splits str into words, casefolded and without marks like utf_fuzz, *
+ * and calls callback for each one (in order, duplicates included).   *
+ * A word is a run of letters and digits. Stops when callback returns  *
+ * non-zero, and returns that (or -1 if str is not valid UTF-8).       */
+int utf_words(const char *str, utf_word_cb_t callback, void *data)
+{
+	int flags = UTF8PROC_NULLTERM | UTF8PROC_STABLE  | UTF8PROC_DECOMPOSE |
+	            UTF8PROC_IGNORE   | UTF8PROC_STRIPCC | UTF8PROC_CASEFOLD  |
+	            UTF8PROC_STRIPMARK;
+	ssize_t ret;
+	int32_t *buf = NULL;
+	uint8_t *word = NULL;
+	int     len = 0;
+	int     r = -1;
+
+	ret = utf8proc_decompose((const uint8_t *)str, 0, NULL, 0, flags);
+	err1(ret < 0);
+	buf = malloc(ret * sizeof(*buf) + 1);
+	word = malloc(ret * 4 + 1);
+	err1(!buf || !word);
+	ret = utf8proc_decompose((const uint8_t *)str, 0, buf, ret, flags);
+	err1(ret < 0);
+	r = 0;
+	for (ssize_t i = 0; i <= ret && !r; i++) {
+		int cat = 0;
+		if (i < ret) cat = utf8proc_get_property(buf[i])->category;
+		if (cat >= UTF8PROC_CATEGORY_LU && cat <= UTF8PROC_CATEGORY_NO) {
+			len += utf8proc_encode_char(buf[i], word + len);
+		} else if (len) {
+			word[len] = '\0';
+			r = callback((const char *)word, data);
+			len = 0;
+		}
+	}
+err:
+	if (buf) free(buf);
+	if (word) free(word);
+	return r;
+}
+
+typedef struct utf_word_list {
+	char   *words; // Each followed by a NUL
+	size_t len;
+	size_t room;
+} utf_word_list_t;
+
+static int utf_word_list_cb(const char *word, void *data)
+{
+	utf_word_list_t *list = data;
+	size_t          z = strlen(word) + 1;
+	if (list->len + z > list->room) {
+		size_t room = (list->len + z) * 2;
+		char   *words = realloc(list->words, room);
+		if (!words) return 1;
+		list->words = words;
+		list->room = room;
+	}
+	memcpy(list->words + list->len, word, z);
+	list->len += z;
+	return 0;
+}
+
+static int utf_word_missing_cb(const char *word, void *data)
+{
+	const utf_word_list_t *list = data;
+	size_t pos = 0;
+	while (pos < list->len) {
+		if (!strcmp(list->words + pos, word)) return 0;
+		pos += strlen(list->words + pos) + 1;
+	}
+	return 1;
+}
+
+/* Whether every word in words is also a word in str. */
+int utf_has_words(const char *str, const char *words)
+{
+	utf_word_list_t list;
+	int             r;
+
+	memset(&list, 0, sizeof(list));
+	r = utf_words(str, utf_word_list_cb, &list);
+	if (!r) r = utf_words(words, utf_word_missing_cb, &list);
+	free(list.words);
+	return !r;
+}